@@ -9,14 +9,3886 @@
 #include <vector>
 #include <cstddef>
 #include <chrono>
+#include <sstream>
+#include <cmath>
+#include <cstdlib>
+#include <deque>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <csignal>
 
 using namespace std;
 
-void print_error(string image_name, string error_message)
+// Adds an error line to the log record of an image.
+void print_error(string &record, string image_name, string error_message)
 {
-    std::cout << "[ERROR] (" << image_name << ") - " << error_message << "\n";
+    record += "[ERROR] (" + image_name + ") - " + error_message + "\n";
 }
 
+/*
+ Computes the widths of three stacked box blurs that approximate a gaussian blur of the given sigma.
+ The widths are odd, and differ at most by two, so that the variance of the three boxes adds up to sigma squared.
+*/
+void gauss_box_sizes(float sigma, int sizes[3])
+{
+    float ideal_width = sqrt(12 * sigma * sigma / 3 + 1);
+    int lower_width = (int)floor(ideal_width);
+    if (lower_width % 2 == 0)
+        lower_width--;
+    int upper_width = lower_width + 2;
+
+    // Number of boxes that use the lower width.
+    float ideal_lower = (12 * sigma * sigma - 3 * lower_width * lower_width - 4 * 3 * lower_width - 3 * 3) / (-4.0f * lower_width - 4);
+    int lower = (int)round(ideal_lower);
+
+    for (int i = 0; i < 3; i++)
+        sizes[i] = i < lower ? lower_width : upper_width;
+}
+
+/*
+ Box blur of radius r along the rows of a plane, using a running sum so the cost per pixel does not depend on r.
+ Pixels outside the image take the value of the nearest pixel in the same row.
+*/
+void box_blur_rows(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int r)
+{
+    int box = 2 * r + 1;
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *in = &src[row * width];
+        unsigned char *out = &dst[row * width];
+
+        // Sum of the window centered on the first pixel.
+        int sum = 0;
+        for (int t = -r; t <= r; t++)
+            sum += in[min(max(t, 0), width - 1)];
+
+        for (int col = 0; col < width; col++)
+        {
+            out[col] = (sum + box / 2) / box;
+            // Slide the window one pixel to the right.
+            sum += in[min(col + r + 1, width - 1)] - in[max(col - r, 0)];
+        }
+    }
+}
+
+/*
+ Box blur of radius r along the columns of a plane.
+ The running sums of all the columns are kept while walking down the rows, so memory is read row by row.
+*/
+void box_blur_cols(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int r)
+{
+    int box = 2 * r + 1;
+    vector<int> sums(width, 0);
+
+    // Sum of the window centered on the first row.
+    for (int s = -r; s <= r; s++)
+    {
+        const unsigned char *in = &src[min(max(s, 0), height - 1) * width];
+        for (int col = 0; col < width; col++)
+            sums[col] += in[col];
+    }
+
+    for (int row = 0; row < height; row++)
+    {
+        unsigned char *out = &dst[row * width];
+        const unsigned char *in_next = &src[min(row + r + 1, height - 1) * width];
+        const unsigned char *in_prev = &src[max(row - r, 0) * width];
+        for (int col = 0; col < width; col++)
+        {
+            out[col] = (sums[col] + box / 2) / box;
+            // Slide the window one row down.
+            sums[col] += in_next[col] - in_prev[col];
+        }
+    }
+}
+
+/*
+ Gaussian blur of arbitrary sigma made of three box blurs in each direction.
+ The result is written in dst and tmp is used as scratch space. Both must have the size of src.
+*/
+void gauss_sigma_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, vector<unsigned char> &tmp, int width, int height, float sigma)
+{
+    int sizes[3];
+    gauss_box_sizes(sigma, sizes);
+
+    box_blur_rows(src, tmp, width, height, (sizes[0] - 1) / 2);
+    box_blur_rows(tmp, dst, width, height, (sizes[1] - 1) / 2);
+    box_blur_rows(dst, tmp, width, height, (sizes[2] - 1) / 2);
+    box_blur_cols(tmp, dst, width, height, (sizes[0] - 1) / 2);
+    box_blur_cols(dst, tmp, width, height, (sizes[1] - 1) / 2);
+    box_blur_cols(tmp, dst, width, height, (sizes[2] - 1) / 2);
+}
+
+/*
+ The fixed 5x5 gaussian blur of STAGE 4 applied to a single plane.
+ Operations outside the image are excluded, and therefore treated as if the result was zero.
+*/
+void gauss_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height)
+{
+    int m[5][5] = {
+        {1, 4, 7, 4, 1},
+        {4, 16, 26, 16, 4},
+        {7, 26, 41, 26, 7},
+        {4, 16, 26, 16, 4},
+        {1, 4, 7, 4, 1}};
+    int weight = 273;
+
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int result = 0;
+
+            // Pixels at least two positions away from the border do not need the bounds checks.
+            if (row >= 2 && row < height - 2 && col >= 2 && col < width - 2)
+            {
+                for (int s = -2; s < 3; s++)
+                {
+                    const unsigned char *in = &src[(row + s) * width + col];
+                    for (int t = -2; t < 3; t++)
+                        result += m[s + 2][t + 2] * in[t];
+                }
+            }
+            else
+            {
+                for (int s = -2; s < 3; s++)
+                {
+                    for (int t = -2; t < 3; t++)
+                    {
+                        if ((row + s >= 0) && (col + t >= 0) && (col + t < width) && (row + s < height))
+                        {
+                            result += m[s + 2][t + 2] * src[(row + s) * width + (col + t)];
+                        }
+                    }
+                }
+            }
+
+            dst[row * width + col] = result / weight;
+        }
+    }
+}
+
+/*
+ The sobel operation of STAGE 5 applied to a single plane.
+ Stores |gx| + |gy| of every pixel, with both masks divided by their weight.
+*/
+void sobel_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height)
+{
+    int mx[3][3] = {
+        {1, 2, 1},
+        {0, 0, 0},
+        {-1, -2, -1}};
+
+    int my[3][3] = {
+        {-1, 0, 1},
+        {-2, 0, 2},
+        {-1, 0, 1}};
+    int w = 8;
+
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int result_x = 0;
+            int result_y = 0;
+
+            for (int s = -1; s < 2; s++)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < width) && (row + s < height))
+                    {
+                        result_x += mx[s + 1][t + 1] * src[(row + s) * width + (col + t)];
+                        result_y += my[s + 1][t + 1] * src[(row + s) * width + (col + t)];
+                    }
+                }
+            }
+
+            dst[row * width + col] = static_cast<unsigned int>(abs((float)result_y / (float)w) + abs((float)result_x / (float)w));
+        }
+    }
+}
+
+// Histogram and statistics of a plane. The sharpness is the variance of the sobel response of the plane.
+struct channel_stats
+{
+    unsigned long long histogram[256];
+    int min;
+    int max;
+    double mean;
+    double sharpness;
+};
+
+/*
+ Statistics of a plane, for the stats step. The sobel response is the one sobel_plane stores, without the blur.
+*/
+void plane_stats(const vector<unsigned char> &src, int width, int height, channel_stats &stats)
+{
+    int mx[3][3] = {
+        {1, 2, 1},
+        {0, 0, 0},
+        {-1, -2, -1}};
+
+    int my[3][3] = {
+        {-1, 0, 1},
+        {-2, 0, 2},
+        {-1, 0, 1}};
+    int w = 8;
+
+    memset(stats.histogram, 0, sizeof(stats.histogram));
+    stats.min = 255;
+    stats.max = 0;
+    unsigned long long sum = 0, response_sum = 0, response_squares = 0;
+
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int value = src[row * width + col];
+            stats.histogram[value]++;
+            stats.min = min(stats.min, value);
+            stats.max = max(stats.max, value);
+            sum += value;
+
+            int result_x = 0;
+            int result_y = 0;
+            for (int s = -1; s < 2; s++)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < width) && (row + s < height))
+                    {
+                        result_x += mx[s + 1][t + 1] * src[(row + s) * width + (col + t)];
+                        result_y += my[s + 1][t + 1] * src[(row + s) * width + (col + t)];
+                    }
+                }
+            }
+            unsigned int response = static_cast<unsigned int>(abs((float)result_y / (float)w) + abs((float)result_x / (float)w));
+            response_sum += response;
+            response_squares += response * response;
+        }
+    }
+
+    double pixels = (double)width * height;
+    double response_mean = response_sum / pixels;
+    stats.mean = sum / pixels;
+    stats.sharpness = response_squares / pixels - response_mean * response_mean;
+}
+
+
+/*
+ Sobel of the 5x5 gaussian blur computed in one step, for the --fused option.
+ The blur is approximated by the separable binomial [1 4 6 4 1] / 16 in each direction and merged with the sobel masks:
+ smoothing [1 4 6 4 1] * [1 2 1] = [1 6 15 20 15 6 1] and derivative [1 4 6 4 1] * [-1 0 1] = [-1 -4 -5 0 5 4 1].
+ Each gradient is one horizontal and one vertical pass of 7 taps (28 taps per pixel instead of 25 + 18).
+ All the arithmetic is integer. The weight of the blur (256) and of the masks (8) are applied once at the end.
+ Outside the image the source is treated as zero. The result can be written over the source.
+ The blur is not exactly separable and is not truncated between stages, so the result is not identical to gauss + sobel:
+ it differs by at most 2 per channel, except in the one pixel frame of the image where the zero padding is applied
+ to the source instead of the blurred image.
+*/
+void sobel_fused_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height)
+{
+    int smooth[7] = {1, 6, 15, 20, 15, 6, 1};
+    int deriv[7] = {-1, -4, -5, 0, 5, 4, 1};
+    int weight = 256 * 8;
+
+    // Horizontal pass. Smoothed values fit in 16 bits (255 * 64) and so do the derivatives (255 * 10).
+    vector<short> row_smooth(width * height);
+    vector<short> row_deriv(width * height);
+    for (int row = 0; row < height; row++)
+    {
+        const unsigned char *in = &src[row * width];
+        for (int col = 0; col < width; col++)
+        {
+            int result_smooth = 0;
+            int result_deriv = 0;
+            for (int t = -3; t < 4; t++)
+            {
+                if (col + t >= 0 && col + t < width)
+                {
+                    result_smooth += smooth[t + 3] * in[col + t];
+                    result_deriv += deriv[t + 3] * in[col + t];
+                }
+            }
+            row_smooth[row * width + col] = result_smooth;
+            row_deriv[row * width + col] = result_deriv;
+        }
+    }
+
+    // Vertical pass. Derivative across rows of the smoothed rows, and smoothing across rows of the derivatives.
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int result_x = 0;
+            int result_y = 0;
+            for (int s = -3; s < 4; s++)
+            {
+                if (row + s >= 0 && row + s < height)
+                {
+                    result_x += deriv[s + 3] * row_smooth[(row + s) * width + col];
+                    result_y += smooth[s + 3] * row_deriv[(row + s) * width + col];
+                }
+            }
+            dst[row * width + col] = (abs(result_x) + abs(result_y)) / weight;
+        }
+    }
+}
+
+/*
+ Median filter of a plane over a (2r+1)x(2r+1) window, in constant time per pixel (Perreault and Hebert).
+ Every column keeps a histogram of the 2r+1 rows around the current row, and the window histogram is updated
+ by adding the column that enters and removing the column that leaves. Both levels are split into 16 coarse
+ and 256 fine bins so the median is found with at most 32 steps. Only the coarse bins of the window follow every
+ step; the 16 fine bins under a coarse bin are brought up to date when the median falls in it.
+ The image is processed in bands of rows, each band with its own histograms. Pixels outside the image take the
+ value of the nearest pixel inside it. The radius must be between 1 and 127.
+*/
+void median_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int r)
+{
+    int band = 64;
+    int half = (2 * r + 1) * (2 * r + 1) / 2;
+
+    for (int first = 0; first < height; first += band)
+    {
+        int last = min(first + band, height);
+
+        // Column histograms, fine and coarse, of the window rows centered on the current row.
+        vector<unsigned short> column_fine(width * 256, 0);
+        vector<unsigned short> column_coarse(width * 16, 0);
+        for (int s = first - r; s <= first + r; s++)
+        {
+            const unsigned char *in = &src[min(max(s, 0), height - 1) * width];
+            for (int col = 0; col < width; col++)
+            {
+                column_fine[col * 256 + in[col]]++;
+                column_coarse[col * 16 + (in[col] >> 4)]++;
+            }
+        }
+
+        for (int row = first; row < last; row++)
+        {
+            // Move the column histograms down to the current row.
+            if (row > first)
+            {
+                const unsigned char *in_prev = &src[max(row - r - 1, 0) * width];
+                const unsigned char *in_next = &src[min(row + r, height - 1) * width];
+                for (int col = 0; col < width; col++)
+                {
+                    column_fine[col * 256 + in_prev[col]]--;
+                    column_coarse[col * 16 + (in_prev[col] >> 4)]--;
+                    column_fine[col * 256 + in_next[col]]++;
+                    column_coarse[col * 16 + (in_next[col] >> 4)]++;
+                }
+            }
+
+            // Window histogram of the first pixel of the row. fine_col holds the column each group of fine bins was
+            // last brought up to date for, and starts far enough to the left to have them built on first use.
+            unsigned short fine[256];
+            unsigned short coarse[16] = {0};
+            int fine_col[16];
+            for (int k = 0; k < 16; k++)
+                fine_col[k] = -2 * r - 2;
+            for (int t = -r; t <= r; t++)
+            {
+                int c = min(max(t, 0), width - 1);
+                for (int k = 0; k < 16; k++)
+                    coarse[k] += column_coarse[c * 16 + k];
+            }
+
+            for (int col = 0; col < width; col++)
+            {
+                // Find the coarse bin holding the median, then the fine bin inside it.
+                int count = 0;
+                int k = 0;
+                while (count + coarse[k] <= half)
+                {
+                    count += coarse[k];
+                    k++;
+                }
+
+                // Bring the fine bins of the coarse bin up to date, by sliding them over the columns they missed or,
+                // when the whole window changed since, by summing the window columns again.
+                unsigned short *group = &fine[k * 16];
+                if (col - fine_col[k] > 2 * r)
+                {
+                    for (int b = 0; b < 16; b++)
+                        group[b] = 0;
+                    for (int t = -r; t <= r; t++)
+                    {
+                        const unsigned short *in = &column_fine[min(max(col + t, 0), width - 1) * 256 + k * 16];
+                        for (int b = 0; b < 16; b++)
+                            group[b] += in[b];
+                    }
+                }
+                else
+                {
+                    for (int c = fine_col[k]; c < col; c++)
+                    {
+                        const unsigned short *in_next = &column_fine[min(c + r + 1, width - 1) * 256 + k * 16];
+                        const unsigned short *in_prev = &column_fine[max(c - r, 0) * 256 + k * 16];
+                        for (int b = 0; b < 16; b++)
+                            group[b] += in_next[b] - in_prev[b];
+                    }
+                }
+                fine_col[k] = col;
+
+                int v = k * 16;
+                while (count + fine[v] <= half)
+                {
+                    count += fine[v];
+                    v++;
+                }
+                dst[row * width + col] = v;
+
+                // Slide the coarse bins of the window one pixel to the right.
+                const unsigned short *coarse_next = &column_coarse[min(col + r + 1, width - 1) * 16];
+                const unsigned short *coarse_prev = &column_coarse[max(col - r, 0) * 16];
+                for (int b = 0; b < 16; b++)
+                    coarse[b] += coarse_next[b] - coarse_prev[b];
+            }
+        }
+    }
+}
+
+/*
+ Bilateral filter of a plane using a bilateral grid (Paris and Durand).
+ Pixels are splatted into a grid downsampled by sigma_s in space and by sigma_r in intensity, the grid is
+ blurred with [1 2 1] along its three axes, and the result is sliced back with trilinear interpolation.
+ The grid has a border of one cell on every side so the blur does not need bounds checks.
+*/
+void bilateral_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int sigma_s, int sigma_r)
+{
+    int grid_width = (width - 1 + sigma_s / 2) / sigma_s + 3;
+    int grid_height = (height - 1 + sigma_s / 2) / sigma_s + 3;
+    int grid_depth = (255 + sigma_r / 2) / sigma_r + 3;
+    int grid_size = grid_width * grid_height * grid_depth;
+
+    // Each cell has the sum of the values splatted into it and their count (the weight).
+    vector<float> values(grid_size, 0);
+    vector<float> weights(grid_size, 0);
+
+    // Splat. The grid rows are filled in turn, each from the image rows nearest to it.
+    for (int gy = 1; gy < grid_height - 1; gy++)
+    {
+        int first = max((gy - 1) * sigma_s - sigma_s / 2, 0);
+        int last = min((gy - 1) * sigma_s - sigma_s / 2 + sigma_s, height);
+        for (int row = first; row < last; row++)
+        {
+            for (int col = 0; col < width; col++)
+            {
+                unsigned char v = src[row * width + col];
+                int gx = (col + sigma_s / 2) / sigma_s + 1;
+                int gz = (v + sigma_r / 2) / sigma_r + 1;
+                int cell = (gy * grid_width + gx) * grid_depth + gz;
+                values[cell] += v;
+                weights[cell] += 1;
+            }
+        }
+    }
+
+    // Blur along the intensity, the columns and the rows of the grid.
+    vector<float> values_tmp(grid_size, 0);
+    vector<float> weights_tmp(grid_size, 0);
+    int steps[3] = {1, grid_depth, grid_width * grid_depth};
+    for (int axis = 0; axis < 3; axis++)
+    {
+        int step = steps[axis];
+        for (int gy = 1; gy < grid_height - 1; gy++)
+        {
+            for (int gx = 1; gx < grid_width - 1; gx++)
+            {
+                for (int gz = 1; gz < grid_depth - 1; gz++)
+                {
+                    int cell = (gy * grid_width + gx) * grid_depth + gz;
+                    values_tmp[cell] = (values[cell - step] + 2 * values[cell] + values[cell + step]) / 4;
+                    weights_tmp[cell] = (weights[cell - step] + 2 * weights[cell] + weights[cell + step]) / 4;
+                }
+            }
+        }
+        values.swap(values_tmp);
+        weights.swap(weights_tmp);
+    }
+
+    // Slice with trilinear interpolation at the position of every pixel.
+    for (int row = 0; row < height; row++)
+    {
+        float y = (float)row / sigma_s + 1;
+        int y0 = (int)y;
+        float fy = y - y0;
+        for (int col = 0; col < width; col++)
+        {
+            unsigned char v = src[row * width + col];
+            float x = (float)col / sigma_s + 1;
+            float z = (float)v / sigma_r + 1;
+            int x0 = (int)x;
+            int z0 = (int)z;
+            float fx = x - x0;
+            float fz = z - z0;
+
+            float value = 0;
+            float weight = 0;
+            for (int c = 0; c < 8; c++)
+            {
+                int dy = (c >> 2) & 1;
+                int dx = (c >> 1) & 1;
+                int dz = c & 1;
+                float f = (dy ? fy : 1 - fy) * (dx ? fx : 1 - fx) * (dz ? fz : 1 - fz);
+                int cell = ((y0 + dy) * grid_width + (x0 + dx)) * grid_depth + (z0 + dz);
+                value += f * values[cell];
+                weight += f * weights[cell];
+            }
+
+            // A pixel always has weight in its own cell, but keep the original value if the weight vanished.
+            dst[row * width + col] = weight > 0 ? (unsigned char)min(value / weight + 0.5f, 255.0f) : v;
+        }
+    }
+}
+
+/*
+ Erosion (minimum) or dilation (maximum) of a plane with a rectangular element of element_width x element_height,
+ using the van Herk / Gil-Werman algorithm separately on rows and columns.
+ Every line is split in blocks of the element size with a running extreme from the left (g) and from the right (h)
+ of each block, so the extreme of any window is max(h[x], g[x + size - 1]) and costs three comparisons per pixel
+ whatever the size. Pixels outside the image are ignored. The result can be written over the source.
+*/
+void morph_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int element_width, int element_height, bool dilate)
+{
+    // Value that does not change the result outside the image.
+    unsigned char identity = dilate ? 0 : 255;
+
+    // Rows. Position i of the padded line holds column i - before.
+    int size = element_width;
+    int before = (size - 1) / 2;
+    int padded = width + size - 1;
+    for (int row = 0; row < height; row++)
+    {
+        vector<unsigned char> g(padded);
+        vector<unsigned char> h(padded);
+        const unsigned char *in = &src[row * width];
+
+        for (int i = 0; i < padded; i++)
+        {
+            int col = i - before;
+            unsigned char v = (col >= 0 && col < width) ? in[col] : identity;
+            g[i] = (i % size == 0) ? v : (dilate ? max(g[i - 1], v) : min(g[i - 1], v));
+        }
+        for (int i = padded - 1; i >= 0; i--)
+        {
+            int col = i - before;
+            unsigned char v = (col >= 0 && col < width) ? in[col] : identity;
+            h[i] = (i % size == size - 1 || i == padded - 1) ? v : (dilate ? max(h[i + 1], v) : min(h[i + 1], v));
+        }
+
+        unsigned char *out = &dst[row * width];
+        for (int col = 0; col < width; col++)
+            out[col] = dilate ? max(h[col], g[col + size - 1]) : min(h[col], g[col + size - 1]);
+    }
+
+    // Columns. The same recurrences run down the rows for a block of columns at a time, reading row by row.
+    size = element_height;
+    before = (size - 1) / 2;
+    padded = height + size - 1;
+    int block = 256;
+    for (int first = 0; first < width; first += block)
+    {
+        int last = min(first + block, width);
+        int block_width = last - first;
+        vector<unsigned char> g(padded * block_width);
+        vector<unsigned char> h(padded * block_width);
+
+        for (int i = 0; i < padded; i++)
+        {
+            int row = i - before;
+            for (int col = first; col < last; col++)
+            {
+                unsigned char v = (row >= 0 && row < height) ? dst[row * width + col] : identity;
+                unsigned char *cell = &g[i * block_width + col - first];
+                *cell = (i % size == 0) ? v : (dilate ? max(cell[-block_width], v) : min(cell[-block_width], v));
+            }
+        }
+        for (int i = padded - 1; i >= 0; i--)
+        {
+            int row = i - before;
+            for (int col = first; col < last; col++)
+            {
+                unsigned char v = (row >= 0 && row < height) ? dst[row * width + col] : identity;
+                unsigned char *cell = &h[i * block_width + col - first];
+                *cell = (i % size == size - 1 || i == padded - 1) ? v : (dilate ? max(cell[block_width], v) : min(cell[block_width], v));
+            }
+        }
+
+        for (int row = 0; row < height; row++)
+        {
+            const unsigned char *hr = &h[row * block_width];
+            const unsigned char *gr = &g[(row + size - 1) * block_width];
+            for (int col = first; col < last; col++)
+                dst[row * width + col] = dilate ? max(hr[col - first], gr[col - first]) : min(hr[col - first], gr[col - first]);
+        }
+    }
+}
+
+// Finds the root of a pixel in the union-find forest of canny_plane, halving the path on the way.
+int find_root(vector<int> &parent, int p)
+{
+    while (parent[p] != p)
+    {
+        parent[p] = parent[parent[p]];
+        p = parent[p];
+    }
+    return p;
+}
+
+// Joins the sets of two pixels. The smaller root becomes the root of both, so the result does not depend on the order.
+void join_roots(vector<int> &parent, int a, int b)
+{
+    a = find_root(parent, a);
+    b = find_root(parent, b);
+    if (a < b)
+        parent[b] = a;
+    else if (b < a)
+        parent[a] = b;
+}
+
+/*
+ Canny edge detector on a plane that has already been blurred by STAGE 4.
+ The gradients are the sobel masks and the magnitude is |gx| + |gy| divided by 8, as in the sobel operation.
+ Pixels that are not a maximum along the gradient direction are suppressed. The rest are strong if their magnitude
+ is at least high and weak if it is at least low. Weak pixels are kept when they are 8-connected to a strong one.
+ The connected components are found with union-find in one pass over the rows.
+ Edges are written as 255 and the rest of pixels as 0.
+*/
+void canny_plane(const vector<unsigned char> &src, vector<unsigned char> &dst, int width, int height, int low, int high)
+{
+    int size = width * height;
+    vector<short> gx(size);
+    vector<short> gy(size);
+    vector<short> magnitude(size);
+
+    // Gradients along the columns (gx) and the rows (gy). Operations outside the image are treated as zero.
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int result_x = 0;
+            int result_y = 0;
+            for (int s = -1; s < 2; s++)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < width) && (row + s < height))
+                    {
+                        int v = src[(row + s) * width + (col + t)];
+                        result_x += t * (2 - abs(s)) * v;
+                        result_y += s * (2 - abs(t)) * v;
+                    }
+                }
+            }
+            gx[row * width + col] = result_x;
+            gy[row * width + col] = result_y;
+            magnitude[row * width + col] = (abs(result_x) + abs(result_y)) / 8;
+        }
+    }
+
+    /*
+     Non-maximum suppression with the direction rounded to 0, 45, 90 or 135 degrees (tan(22.5) is about 106 / 256).
+     Candidates are the pixels that survive with at least the low threshold.
+    */
+    vector<unsigned char> candidate(size);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int j = row * width + col;
+            int ax = abs(gx[j]);
+            int ay = abs(gy[j]);
+            int dr;
+            int dc;
+            if (ay * 256 <= ax * 106)
+            {
+                dr = 0;
+                dc = 1;
+            }
+            else if (ax * 256 <= ay * 106)
+            {
+                dr = 1;
+                dc = 0;
+            }
+            else
+            {
+                dr = 1;
+                dc = (gx[j] > 0) == (gy[j] > 0) ? 1 : -1;
+            }
+
+            int ahead = 0;
+            int behind = 0;
+            if (row + dr < height && col + dc >= 0 && col + dc < width)
+                ahead = magnitude[(row + dr) * width + col + dc];
+            if (row - dr >= 0 && col - dc >= 0 && col - dc < width)
+                behind = magnitude[(row - dr) * width + col - dc];
+
+            // Ties keep the pixel behind, so flat ridges stay one pixel wide.
+            candidate[j] = magnitude[j] >= low && magnitude[j] > ahead && magnitude[j] >= behind;
+        }
+    }
+
+    // Union-find of every candidate with its neighbours to the left and in the row above.
+    vector<int> parent(size);
+    for (int row = 0; row < height; row++)
+    {
+        for (int col = 0; col < width; col++)
+        {
+            int j = row * width + col;
+            parent[j] = j;
+            if (!candidate[j])
+                continue;
+            if (col > 0 && candidate[j - 1])
+                join_roots(parent, j, j - 1);
+            if (row > 0)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+                    if (col + t >= 0 && col + t < width && candidate[j - width + t])
+                        join_roots(parent, j, j - width + t);
+                }
+            }
+        }
+    }
+
+    // Flatten the forest so every pixel points to its root. Parents always have a smaller index, so one pass in order is enough.
+    for (int j = 0; j < size; j++)
+        parent[j] = parent[parent[j]];
+
+    // Mark the components that have at least one strong pixel.
+    vector<unsigned char> strong(size, 0);
+    for (int j = 0; j < size; j++)
+    {
+        if (candidate[j] && magnitude[j] >= high)
+        {
+            strong[parent[j]] = 1;
+        }
+    }
+
+    for (int j = 0; j < size; j++)
+        dst[j] = (candidate[j] && strong[parent[j]]) ? 255 : 0;
+}
+
+/*
+ Rotates or flips a padded 24-bit pixel array: rotate90 and rotate270 are clockwise and counterclockwise,
+ flip-h mirrors left to right and flip-v top to bottom. BMP rows are stored from the bottom up.
+ Every transform is a linear map from (row, col) of the source to (row, col) of the destination, so the copy walks
+ the source in square tiles and only adds a fixed step per pixel. Tiles keep both the rows read and the rows
+ written in cache, which matters for the rotations where consecutive source pixels land in different rows.
+ The width and height are updated and dst gets the padding of the new width.
+*/
+void transform_pixels(const vector<unsigned char> &src, vector<unsigned char> &dst, unsigned int &width, unsigned int &height, const string &transform)
+{
+    int w = width;
+    int h = height;
+    bool swap = transform == "rotate90" || transform == "rotate270";
+    int new_width = swap ? h : w;
+    int new_height = swap ? w : h;
+    int src_real_width = (w * 3 + 3) / 4 * 4;
+    int dst_real_width = (new_width * 3 + 3) / 4 * 4;
+
+    // Destination row = row_base + row_y * y + row_x * x, and the same for the column.
+    int row_base = 0, row_y = 1, row_x = 0;
+    int col_base = 0, col_y = 0, col_x = 1;
+    if (transform == "rotate90")
+    {
+        row_base = w - 1, row_y = 0, row_x = -1;
+        col_base = 0, col_y = 1, col_x = 0;
+    }
+    else if (transform == "rotate180")
+    {
+        row_base = h - 1, row_y = -1, row_x = 0;
+        col_base = w - 1, col_y = 0, col_x = -1;
+    }
+    else if (transform == "rotate270")
+    {
+        row_base = 0, row_y = 0, row_x = 1;
+        col_base = h - 1, col_y = -1, col_x = 0;
+    }
+    else if (transform == "flip-h")
+    {
+        col_base = w - 1, col_x = -1;
+    }
+    else if (transform == "flip-v")
+    {
+        row_base = h - 1, row_y = -1;
+    }
+
+    // Byte step in the destination for one pixel to the right in the source.
+    long step_x = (long)row_x * dst_real_width + col_x * 3;
+
+    dst.assign((size_t)dst_real_width * new_height, 0);
+    int tile = 64;
+    for (int tile_y = 0; tile_y < h; tile_y += tile)
+    {
+        for (int tile_x = 0; tile_x < w; tile_x += tile)
+        {
+            for (int y = tile_y; y < min(tile_y + tile, h); y++)
+            {
+                const unsigned char *in = &src[(size_t)y * src_real_width + tile_x * 3];
+                unsigned char *out = &dst[(long)(row_base + row_y * y + row_x * tile_x) * dst_real_width + (col_base + col_y * y + col_x * tile_x) * 3];
+                for (int x = tile_x; x < min(tile_x + tile, w); x++)
+                {
+                    out[0] = in[0];
+                    out[1] = in[1];
+                    out[2] = in[2];
+                    in += 3;
+                    out += step_x;
+                }
+            }
+        }
+    }
+
+    width = new_width;
+    height = new_height;
+}
+
+/*
+ Reads the pixel array of a bmp file row by row and reduces it to thumb_width x thumb_height by area averaging,
+ so the full resolution image is never stored. Each destination pixel is the average of the source area it covers,
+ with partially covered source pixels weighted by the covered fraction. Working in units where a source pixel is
+ thumb_width long and a destination pixel is width long keeps every weight an exact integer.
+ Only two destination rows are accumulated at a time. The result is a padded pixel array in dst.
+*/
+void load_thumbnail(istream &ifs, unsigned int start_byte, unsigned int width, unsigned int height, unsigned int thumb_width, unsigned int thumb_height, vector<unsigned char> &dst)
+{
+    int src_real_width = (width * 3 + 3) / 4 * 4;
+    int dst_real_width = (thumb_width * 3 + 3) / 4 * 4;
+    dst.assign((size_t)dst_real_width * thumb_height, 0);
+
+    // Destination column of every source column, and the part of the source pixel that falls in it.
+    vector<unsigned int> first_col(width);
+    vector<unsigned int> first_overlap(width);
+    for (unsigned int x = 0; x < width; x++)
+    {
+        first_col[x] = (unsigned long long)x * thumb_width / width;
+        unsigned long long boundary = (unsigned long long)(first_col[x] + 1) * width;
+        first_overlap[x] = min((unsigned long long)(x + 1) * thumb_width, boundary) - (unsigned long long)x * thumb_width;
+    }
+
+    vector<unsigned char> row_in(src_real_width);
+    vector<unsigned long long> row_sum(thumb_width * 3);
+    vector<unsigned long long> acc[2] = {vector<unsigned long long>(thumb_width * 3, 0), vector<unsigned long long>(thumb_width * 3, 0)};
+    unsigned long long area = (unsigned long long)width * height;
+    unsigned int next_row = 0;
+
+    ifs.seekg(start_byte, ios::beg);
+    for (unsigned int y = 0; y < height; y++)
+    {
+        ifs.read((char *)&row_in[0], src_real_width);
+
+        // Horizontal reduction of the row.
+        fill(row_sum.begin(), row_sum.end(), 0);
+        for (unsigned int x = 0; x < width; x++)
+        {
+            unsigned int col = first_col[x];
+            unsigned int rest = thumb_width - first_overlap[x];
+            for (int c = 0; c < 3; c++)
+            {
+                row_sum[col * 3 + c] += (unsigned long long)row_in[x * 3 + c] * first_overlap[x];
+                if (rest > 0)
+                    row_sum[(col + 1) * 3 + c] += (unsigned long long)row_in[x * 3 + c] * rest;
+            }
+        }
+
+        // Vertical accumulation into the one or two destination rows covered by this source row.
+        unsigned int row = (unsigned long long)y * thumb_height / height;
+        unsigned long long boundary = (unsigned long long)(row + 1) * height;
+        unsigned int overlap = min((unsigned long long)(y + 1) * thumb_height, boundary) - (unsigned long long)y * thumb_height;
+        unsigned int rest = thumb_height - overlap;
+        for (unsigned int k = 0; k < thumb_width * 3; k++)
+        {
+            acc[row % 2][k] += row_sum[k] * overlap;
+            if (rest > 0)
+                acc[(row + 1) % 2][k] += row_sum[k] * rest;
+        }
+
+        // Write the destination rows whose area is complete.
+        while (next_row < thumb_height && (unsigned long long)(y + 1) * thumb_height >= (unsigned long long)(next_row + 1) * height)
+        {
+            vector<unsigned long long> &done = acc[next_row % 2];
+            for (unsigned int k = 0; k < thumb_width * 3; k++)
+            {
+                dst[(size_t)next_row * dst_real_width + k] = (done[k] + area / 2) / area;
+                done[k] = 0;
+            }
+            next_row++;
+        }
+    }
+}
+
+// Copies a rectangle of pixels between two padded pixel arrays. Rows are counted as stored, from the bottom.
+void copy_region(const vector<unsigned char> &src, int src_width, int src_col, int src_row,
+                 vector<unsigned char> &dst, int dst_width, int dst_col, int dst_row, int width, int height)
+{
+    int src_real_width = (src_width * 3 + 3) / 4 * 4;
+    int dst_real_width = (dst_width * 3 + 3) / 4 * 4;
+    for (int row = 0; row < height; row++)
+    {
+        memcpy(&dst[(size_t)(dst_row + row) * dst_real_width + dst_col * 3],
+               &src[(size_t)(src_row + row) * src_real_width + src_col * 3], width * 3);
+    }
+}
+
+// Rectangle of pixels of an image. Rows are counted as stored, from the bottom.
+struct rectangle
+{
+    int col;
+    int row;
+    int width;
+    int height;
+};
+
+// Grows a rectangle by margin pixels on every side, clipped to the image.
+rectangle grow_rectangle(rectangle r, int margin, int width, int height)
+{
+    rectangle g;
+    g.col = max(r.col - margin, 0);
+    g.row = max(r.row - margin, 0);
+    g.width = min(r.col + r.width + margin, width) - g.col;
+    g.height = min(r.row + r.height + margin, height) - g.row;
+    return g;
+}
+
+/*
+ Merges the rectangles whose areas grown by margin overlap into the rectangle that covers both, until none overlap,
+ so no pixel is filtered twice. Returns the pixels of the rectangles grown by margin, the area that is filtered.
+*/
+unsigned long long merge_regions(vector<rectangle> &regions, int margin, int width, int height)
+{
+    bool merged = true;
+    while (merged)
+    {
+        merged = false;
+        for (unsigned int i = 0; i < regions.size() && !merged; i++)
+        {
+            for (unsigned int j = i + 1; j < regions.size() && !merged; j++)
+            {
+                rectangle a = grow_rectangle(regions[i], margin, width, height);
+                rectangle b = grow_rectangle(regions[j], margin, width, height);
+                if (a.col < b.col + b.width && b.col < a.col + a.width && a.row < b.row + b.height && b.row < a.row + a.height)
+                {
+                    rectangle &r = regions[i];
+                    const rectangle &s = regions[j];
+                    int col = min(r.col, s.col);
+                    int row = min(r.row, s.row);
+                    r.width = max(r.col + r.width, s.col + s.width) - col;
+                    r.height = max(r.row + r.height, s.row + s.height) - row;
+                    r.col = col;
+                    r.row = row;
+                    regions.erase(regions.begin() + j);
+                    merged = true;
+                }
+            }
+        }
+    }
+
+    unsigned long long area = 0;
+    for (unsigned int k = 0; k < regions.size(); k++)
+    {
+        rectangle g = grow_rectangle(regions[k], margin, width, height);
+        area += (unsigned long long)g.width * g.height;
+    }
+    return area;
+}
+
+/*
+ Reads the pixel array of a 24-bit uncompressed bmp file, for the previous images of the incremental mode.
+ Returns false if the file cannot be read or is not a valid image.
+*/
+bool read_bmp_pixels(const string &path, unsigned int &width, unsigned int &height, vector<unsigned char> &pixels)
+{
+    ifstream ifs(path, ios::binary | ios::ate);
+    if (!ifs)
+        return false;
+    long long size = ifs.tellg();
+    unsigned char header[54];
+    ifs.seekg(0, ios::beg);
+    if (size < 54 || !ifs.read((char *)header, 54))
+        return false;
+
+    unsigned int planes = header[26] + (header[27] << 8);
+    unsigned int point_size = header[28] + (header[29] << 8);
+    unsigned int compression = header[30] + (header[31] << 8) + (header[32] << 16) + ((unsigned int)header[33] << 24);
+    unsigned int start_byte = header[10] + (header[11] << 8) + (header[12] << 16) + ((unsigned int)header[13] << 24);
+    width = header[18] + (header[19] << 8) + (header[20] << 16) + ((unsigned int)header[21] << 24);
+    height = header[22] + (header[23] << 8) + (header[24] << 16) + ((unsigned int)header[25] << 24);
+    if (header[0] != 'B' || header[1] != 'M' || planes != 1 || point_size != 24 || compression != 0)
+        return false;
+    if (width == 0 || height == 0 || (unsigned long long)width * height > 400000000)
+        return false;
+
+    unsigned long long pixel_bytes = (3ULL * width + 3) / 4 * 4 * height;
+    if (start_byte < 54 || start_byte + pixel_bytes > (unsigned long long)size)
+        return false;
+
+    pixels.resize(pixel_bytes);
+    ifs.seekg(start_byte, ios::beg);
+    return (bool)ifs.read((char *)&pixels[0], pixel_bytes);
+}
+
+/*
+ Decodes the chunks of a QOI image (the data after its 14 byte header) into a pixel array laid out like the one of
+ a bmp: rows from the bottom, padded to four bytes, with the bytes of a pixel in the order blue, green, red.
+ The alpha channel is dropped. Returns false if the data ends before the last pixel.
+*/
+bool decode_qoi(const vector<unsigned char> &data, unsigned int width, unsigned int height, vector<unsigned char> &pixels)
+{
+    int real_width = (width * 3 + 3) / 4 * 4;
+    pixels.assign((size_t)real_width * height, 0);
+
+    // Pixels seen before, by the hash of their colour. The previous pixel starts as opaque black.
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char r = 0, g = 0, b = 0, a = 255;
+    unsigned int run = 0;
+    size_t p = 0;
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        // QOI stores the rows from the top.
+        unsigned char *row = &pixels[(size_t)(height - 1 - y) * real_width];
+        for (unsigned int x = 0; x < width; x++)
+        {
+            if (run > 0)
+            {
+                run--;
+            }
+            else
+            {
+                if (p >= data.size())
+                    return false;
+                unsigned char b1 = data[p++];
+                if (b1 == 0xfe)
+                {
+                    if (p + 3 > data.size())
+                        return false;
+                    r = data[p];
+                    g = data[p + 1];
+                    b = data[p + 2];
+                    p += 3;
+                }
+                else if (b1 == 0xff)
+                {
+                    if (p + 4 > data.size())
+                        return false;
+                    r = data[p];
+                    g = data[p + 1];
+                    b = data[p + 2];
+                    a = data[p + 3];
+                    p += 4;
+                }
+                else if ((b1 & 0xc0) == 0x00)
+                {
+                    r = index[b1][0];
+                    g = index[b1][1];
+                    b = index[b1][2];
+                    a = index[b1][3];
+                }
+                else if ((b1 & 0xc0) == 0x40)
+                {
+                    r += ((b1 >> 4) & 3) - 2;
+                    g += ((b1 >> 2) & 3) - 2;
+                    b += (b1 & 3) - 2;
+                }
+                else if ((b1 & 0xc0) == 0x80)
+                {
+                    if (p >= data.size())
+                        return false;
+                    unsigned char b2 = data[p++];
+                    int dg = (b1 & 0x3f) - 32;
+                    r += dg - 8 + ((b2 >> 4) & 0x0f);
+                    g += dg;
+                    b += dg - 8 + (b2 & 0x0f);
+                }
+                else
+                {
+                    run = b1 & 0x3f;
+                }
+
+                unsigned char *seen = index[(r * 3 + g * 5 + b * 7 + a * 11) % 64];
+                seen[0] = r;
+                seen[1] = g;
+                seen[2] = b;
+                seen[3] = a;
+            }
+
+            row[x * 3] = b;
+            row[x * 3 + 1] = g;
+            row[x * 3 + 2] = r;
+        }
+    }
+    return true;
+}
+
+/*
+ Writes a pixel array laid out like the one of a bmp as a QOI image with three channels.
+ The rows are encoded from the top one at a time, and every encoded row is written before the next one is encoded,
+ so the store does not hold the whole encoded image. A run of equal pixels may continue into the next row.
+*/
+void write_qoi(ostream &file, const vector<unsigned char> &pixels, unsigned int width, unsigned int height)
+{
+    int real_width = (width * 3 + 3) / 4 * 4;
+
+    unsigned char header[14] = {'q', 'o', 'i', 'f',
+                                (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                                (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                                3, 0};
+    file.write((const char *)header, sizeof(header));
+
+    /*
+     Pixels seen before, by the hash of their colour. Every pixel is opaque, but the alpha is kept as in the decoder,
+     where the unused entries are transparent black and must not match an opaque black pixel.
+    */
+    unsigned char index[64][4];
+    memset(index, 0, sizeof(index));
+    unsigned char pr = 0, pg = 0, pb = 0;
+    unsigned int run = 0;
+
+    // A chunk is at most four bytes, plus the end marker after the last row.
+    vector<unsigned char> out;
+    out.reserve((size_t)width * 4 + 8);
+
+    for (unsigned int y = 0; y < height; y++)
+    {
+        const unsigned char *row = &pixels[(size_t)(height - 1 - y) * real_width];
+        for (unsigned int x = 0; x < width; x++)
+        {
+            unsigned char b = row[x * 3];
+            unsigned char g = row[x * 3 + 1];
+            unsigned char r = row[x * 3 + 2];
+            bool last = y == height - 1 && x == width - 1;
+
+            if (r == pr && g == pg && b == pb)
+            {
+                run++;
+                if (run == 62 || last)
+                {
+                    out.push_back(0xc0 | (run - 1));
+                    run = 0;
+                }
+                continue;
+            }
+
+            if (run > 0)
+            {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+
+            int hash = (r * 3 + g * 5 + b * 7 + 255 * 11) % 64;
+            if (index[hash][0] == r && index[hash][1] == g && index[hash][2] == b && index[hash][3] == 255)
+            {
+                out.push_back(hash);
+            }
+            else
+            {
+                index[hash][0] = r;
+                index[hash][1] = g;
+                index[hash][2] = b;
+                index[hash][3] = 255;
+
+                signed char dr = r - pr;
+                signed char dg = g - pg;
+                signed char db = b - pb;
+                signed char dr_dg = dr - dg;
+                signed char db_dg = db - dg;
+                if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+                {
+                    out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+                }
+                else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7)
+                {
+                    out.push_back(0x80 | (dg + 32));
+                    out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+                }
+                else
+                {
+                    out.push_back(0xfe);
+                    out.push_back(r);
+                    out.push_back(g);
+                    out.push_back(b);
+                }
+            }
+            pr = r;
+            pg = g;
+            pb = b;
+        }
+
+        if (y == height - 1)
+        {
+            const unsigned char end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+            out.insert(out.end(), end, end + 8);
+        }
+        file.write((const char *)out.data(), out.size());
+        out.clear();
+    }
+}
+
+/*
+ Compares two pixel arrays of the same size in blocks of 16 rows and returns the rectangles that changed.
+ Each block gives the rectangle between its first and last changed rows and columns, and consecutive changed blocks
+ whose columns overlap are merged.
+*/
+vector<rectangle> dirty_regions(const vector<unsigned char> &before, const vector<unsigned char> &after, int width, int height)
+{
+    vector<rectangle> regions;
+    int real_width = (width * 3 + 3) / 4 * 4;
+    int block = 16;
+    for (int first = 0; first < height; first += block)
+    {
+        int first_col = width, last_col = -1, first_row = -1, last_row = -1;
+        for (int row = first; row < min(first + block, height); row++)
+        {
+            const unsigned char *a = &before[(size_t)row * real_width];
+            const unsigned char *b = &after[(size_t)row * real_width];
+            if (memcmp(a, b, width * 3) == 0)
+                continue;
+
+            int left = 0;
+            while (a[left] == b[left])
+                left++;
+            int right = width * 3 - 1;
+            while (a[right] == b[right])
+                right--;
+
+            first_col = min(first_col, left / 3);
+            last_col = max(last_col, right / 3);
+            if (first_row < 0)
+                first_row = row;
+            last_row = row;
+        }
+        if (first_row < 0)
+            continue;
+
+        rectangle r;
+        r.col = first_col;
+        r.row = first_row;
+        r.width = last_col - first_col + 1;
+        r.height = last_row - first_row + 1;
+
+        // Merge with the previous rectangle when it ends in the block before and shares columns.
+        if (!regions.empty())
+        {
+            rectangle &p = regions.back();
+            if (p.row + p.height >= first && p.col <= r.col + r.width && r.col <= p.col + p.width)
+            {
+                int col = min(p.col, r.col);
+                p.width = max(p.col + p.width, r.col + r.width) - col;
+                p.col = col;
+                p.height = r.row + r.height - p.row;
+                continue;
+            }
+        }
+        regions.push_back(r);
+    }
+    return regions;
+}
+
+/*
+ A bundle packs many images in a single file, so they are read and written without opening a file per image.
+ The images follow an 8 byte magic one after the other, and an index at the end of the file gives the name,
+ the offset and the size of every image:
+   "IMGBUND1" | images | index: (name size u32, name, offset u64, size u64) per image | index offset u64 | images u32 | "IMGBUND1"
+ Numbers are little endian. With the index at the end, the images can be appended in the order they finish.
+*/
+struct bundle_entry
+{
+    string name;
+    unsigned long long offset;
+    unsigned long long size;
+};
+
+// Input bundle mapped in memory once, with the position of every image name in the index.
+struct bundle_reader
+{
+    const unsigned char *data = NULL;
+    size_t size = 0;
+    vector<bundle_entry> entries;
+    unordered_map<string, unsigned int> positions;
+};
+
+/*
+ Output bundle that the images are appended to, and the index that is written when it is finished.
+ Written as frames, every image is preceded by its name and its size and there is no index, so a reader can take
+ the images while they arrive.
+*/
+struct bundle_writer
+{
+    ofstream file;
+    ostream *out = NULL;
+    bool frames = false;
+    unsigned long long offset = 0;
+    vector<bundle_entry> entries;
+};
+
+// Adds a little endian number of the given bytes to out.
+void put_number(string &out, unsigned long long value, int bytes)
+{
+    for (int k = 0; k < bytes; k++)
+        out += (char)(value >> (8 * k));
+}
+
+// Reads a little endian number of the given bytes.
+unsigned long long get_number(const unsigned char *p, int bytes)
+{
+    unsigned long long value = 0;
+    for (int k = bytes - 1; k >= 0; k--)
+        value = (value << 8) | p[k];
+    return value;
+}
+
+bool read_bundle_index(bundle_reader &bundle);
+
+/*
+ Maps the bundle in path and reads its index. Returns false if the file is not a bundle, or an image or the index
+ are not inside the file.
+*/
+bool open_bundle(const string &path, bundle_reader &bundle)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < 28)
+    {
+        close(fd);
+        return false;
+    }
+    void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        return false;
+    bundle.data = (const unsigned char *)mapped;
+    bundle.size = info.st_size;
+
+    if (!read_bundle_index(bundle))
+    {
+        munmap(mapped, bundle.size);
+        bundle.data = NULL;
+        return false;
+    }
+    return true;
+}
+
+/*
+ Reads the index of the bundle in bundle.data. Returns false if the data is not a bundle, or an image or the index
+ are not inside it.
+*/
+bool read_bundle_index(bundle_reader &bundle)
+{
+    if (bundle.size < 28)
+        return false;
+    const unsigned char *trailer = bundle.data + bundle.size - 20;
+    unsigned long long index_offset = get_number(trailer, 8);
+    unsigned int count = get_number(trailer + 8, 4);
+    bool valid = memcmp(bundle.data, "IMGBUND1", 8) == 0 && memcmp(trailer + 12, "IMGBUND1", 8) == 0 &&
+                 index_offset >= 8 && index_offset <= bundle.size - 20;
+
+    const unsigned char *p = bundle.data + index_offset;
+    const unsigned char *end = trailer;
+    for (unsigned int k = 0; valid && k < count; k++)
+    {
+        bundle_entry entry;
+        unsigned int name_size = end - p >= 4 ? get_number(p, 4) : 0;
+        valid = end - p >= 4 + (long long)name_size + 16 && name_size > 0;
+        if (!valid)
+            break;
+        entry.name.assign((const char *)p + 4, name_size);
+        entry.offset = get_number(p + 4 + name_size, 8);
+        entry.size = get_number(p + 12 + name_size, 8);
+        p += 20 + name_size;
+        valid = entry.offset >= 8 && entry.offset <= index_offset && entry.size <= index_offset - entry.offset;
+        bundle.positions[entry.name] = bundle.entries.size();
+        bundle.entries.push_back(entry);
+    }
+    return valid;
+}
+
+// Unmaps an input bundle.
+void close_bundle(bundle_reader &bundle)
+{
+    if (bundle.data != NULL)
+        munmap((void *)bundle.data, bundle.size);
+    bundle.data = NULL;
+}
+
+// Creates the output bundle in path, or on stdout when it is -, and writes its magic.
+bool create_bundle(const string &path, bundle_writer &bundle, bool frames)
+{
+    bundle.frames = frames;
+    if (path == "-")
+    {
+        bundle.out = &cout;
+    }
+    else
+    {
+        bundle.file.open(path, ios::binary | ios::trunc);
+        if (!bundle.file)
+            return false;
+        bundle.out = &bundle.file;
+    }
+    bundle.out->write(frames ? "IMGSTRM1" : "IMGBUND1", 8);
+    bundle.offset = 8;
+    return true;
+}
+
+// Appends an encoded image to the output bundle.
+void append_to_bundle(bundle_writer &bundle, const string &name, const string &bytes)
+{
+    {
+        if (bundle.frames)
+        {
+            string frame;
+            put_number(frame, name.size(), 4);
+            frame += name;
+            put_number(frame, bytes.size(), 8);
+            bundle.out->write(frame.data(), frame.size());
+            bundle.offset += frame.size();
+        }
+        bundle_entry entry = {name, bundle.offset, bytes.size()};
+        bundle.out->write(bytes.data(), bytes.size());
+        bundle.offset += bytes.size();
+        bundle.entries.push_back(entry);
+        if (bundle.frames)
+            bundle.out->flush();
+    }
+}
+
+// Writes the index and the trailer of the output bundle, and closes it. Frames have nothing after the last image.
+void finish_bundle(bundle_writer &bundle)
+{
+    if (bundle.frames)
+    {
+        bundle.out->flush();
+        return;
+    }
+
+    string index;
+    for (unsigned int k = 0; k < bundle.entries.size(); k++)
+    {
+        put_number(index, bundle.entries[k].name.size(), 4);
+        index += bundle.entries[k].name;
+        put_number(index, bundle.entries[k].offset, 8);
+        put_number(index, bundle.entries[k].size, 8);
+    }
+    put_number(index, bundle.offset, 8);
+    put_number(index, bundle.entries.size(), 4);
+    index += "IMGBUND1";
+    bundle.out->write(index.data(), index.size());
+    bundle.out->flush();
+    if (bundle.file.is_open())
+        bundle.file.close();
+}
+
+/*
+ Read only stream buffer over bytes in memory, so an image of a mapped bundle is read like a file.
+*/
+struct memory_buffer : streambuf
+{
+    void assign(const unsigned char *data, size_t size)
+    {
+        setg((char *)data, (char *)data, (char *)data + size);
+    }
+
+    pos_type seekoff(off_type off, ios_base::seekdir dir, ios_base::openmode) override
+    {
+        off_type position = off + (dir == ios_base::beg ? 0 : dir == ios_base::cur ? gptr() - eback() : egptr() - eback());
+        if (position < 0 || position > egptr() - eback())
+            return pos_type(off_type(-1));
+        setg(eback(), eback() + position, egptr());
+        return pos_type(position);
+    }
+
+    pos_type seekpos(pos_type pos, ios_base::openmode which) override
+    {
+        return seekoff(off_type(pos), ios_base::beg, which);
+    }
+};
+
+// Pixels of the image that starts with header, from the dimensions of a bmp or QOI header. Zero for other files.
+unsigned long long header_pixels(const unsigned char *header, size_t size)
+{
+    if (size >= 26 && header[0] == 'B' && header[1] == 'M')
+    {
+        long long width = (int)get_number(header + 18, 4);
+        long long height = (int)get_number(header + 22, 4);
+        return (unsigned long long)llabs(width) * llabs(height);
+    }
+    if (size >= 14 && memcmp(header, "qoif", 4) == 0)
+    {
+        unsigned long long width = ((unsigned long long)header[4] << 24) | (header[5] << 16) | (header[6] << 8) | header[7];
+        unsigned long long height = ((unsigned long long)header[8] << 24) | (header[9] << 16) | (header[10] << 8) | header[11];
+        return width * height;
+    }
+    return 0;
+}
+
+// Pixels of the image name, from its header in the directory in_path or in the bundle. Zero for other files.
+unsigned long long image_pixels(const string &in_path, const bundle_reader *bundle, const string &name)
+{
+    unsigned char header[26];
+    size_t read = 0;
+    if (bundle != NULL)
+    {
+        const bundle_entry &entry = bundle->entries[bundle->positions.at(name)];
+        read = min((unsigned long long)sizeof(header), entry.size);
+        memcpy(header, bundle->data + entry.offset, read);
+    }
+    else
+    {
+        ifstream file(in_path + "/" + name, ios::binary);
+        file.read((char *)header, sizeof(header));
+        read = file.gcount();
+    }
+    return header_pixels(header, read);
+}
+
+// FNV-1a hash of a file name. It only depends on the name, so every worker gets the same value.
+unsigned long long name_hash(const string &name)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (unsigned char c : name)
+    {
+        hash ^= c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ Keeps in names only the files of shard index out of count. By default a file goes to the shard of its name hash.
+ By size, the files are sorted from the largest image to the smallest, with the name breaking ties, and each one
+ goes to the shard with the fewest pixels so far. The sizes come from the headers, of the directory files or of the
+ bundle, so every worker that lists the same input computes the same split without talking to the others.
+*/
+void select_shard(vector<string> &names, const string &in_path, const bundle_reader *bundle, unsigned int index, unsigned int count, bool by_size)
+{
+    vector<string> selected;
+    if (!by_size)
+    {
+        for (unsigned int k = 0; k < names.size(); k++)
+            if (name_hash(names[k]) % count == index)
+                selected.push_back(names[k]);
+        names.swap(selected);
+        return;
+    }
+
+    vector<pair<unsigned long long, string>> sizes;
+    for (unsigned int k = 0; k < names.size(); k++)
+        sizes.push_back(make_pair(image_pixels(in_path, bundle, names[k]), names[k]));
+    sort(sizes.begin(), sizes.end(), [](const pair<unsigned long long, string> &a, const pair<unsigned long long, string> &b) {
+        return a.first != b.first ? a.first > b.first : a.second < b.second;
+    });
+
+    vector<unsigned long long> loads(count, 0);
+    for (unsigned int k = 0; k < sizes.size(); k++)
+    {
+        unsigned int shard = 0;
+        for (unsigned int s = 1; s < count; s++)
+            if (loads[s] < loads[shard])
+                shard = s;
+        // Empty files still count one pixel, so they are spread instead of all going to the same shard.
+        loads[shard] += max(sizes[k].first, 1ULL);
+        if (shard == index)
+            selected.push_back(sizes[k].second);
+    }
+    names.swap(selected);
+}
+
+/*
+ Claims the image name for this process in the claims directory that the workers share. The lock file is created
+ only if it does not exist, and holds the host and the process of the worker. An image whose .done file exists is
+ finished and not claimed again. The lock of a worker that is gone is taken over: on the same host when its process
+ no longer exists, and on any host once the lock is older than timeout seconds. Two workers that take over the
+ same lock at once can both process the image, which only writes the same output twice.
+*/
+bool claim_image(const string &claims, const string &name, int timeout)
+{
+    string lock = claims + "/" + name + ".lock";
+    string done = claims + "/" + name + ".done";
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (access(done.c_str(), F_OK) == 0)
+            return false;
+
+        int fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (fd >= 0)
+        {
+            string owner = string(host) + " " + to_string(getpid()) + "\n";
+            bool written = write(fd, owner.data(), owner.size()) == (ssize_t)owner.size();
+            close(fd);
+            return written;
+        }
+        if (errno != EEXIST)
+            return false;
+
+        // The lock exists. Look for its worker.
+        struct stat info;
+        if (stat(lock.c_str(), &info) != 0)
+            continue;
+        ifstream file(lock);
+        string owner_host;
+        long owner_pid = 0;
+        file >> owner_host >> owner_pid;
+        bool gone = owner_host == host && owner_pid > 0 && kill(owner_pid, 0) != 0 && errno == ESRCH;
+        bool expired = time(NULL) - info.st_mtime > timeout;
+        if (!gone && !expired)
+            return false;
+        unlink(lock.c_str());
+    }
+    return false;
+}
+
+// Marks a claimed image as finished, so no other worker processes it.
+void finish_claim(const string &claims, const string &name)
+{
+    string lock = claims + "/" + name + ".lock";
+    string done = claims + "/" + name + ".done";
+    rename(lock.c_str(), done.c_str());
+}
+
+// Operation selected in the command line and the parameters of the filters.
+struct options
+{
+    // Geometric transforms applied before the filter, e.g. rotate90,flip-h,sobel.
+    vector<string> transforms;
+
+    // The thumbnail reduction can only be the first step, since it is done while the file is read.
+    bool thumbnail = false;
+
+    // Filter at the end of the operation. Without a filter the image is copied.
+    string operation = "copy";
+
+    // One flag per filter operation.
+    bool gauss = false;
+    bool sobel = false;
+    bool sobel_luma = false;
+    bool median = false;
+    bool bilateral = false;
+    bool erode = false;
+    bool dilate = false;
+    bool morph_open = false;
+    bool morph_close = false;
+    bool morphology = false;
+    bool canny = false;
+
+    // Write the histograms and statistics of every image as JSON next to it, from the planes before the filter.
+    bool stats = false;
+
+    // Standard deviation of the gaussian blur. When it is zero the fixed 5x5 matrix is used.
+    float sigma = 0;
+
+    // Compute sobel and the blur before it in one step (sobel and sobel-luma only).
+    bool fused = false;
+
+    // Radius of the median window.
+    int radius = 1;
+
+    // Spatial (pixels) and range (intensity levels) sigmas of the bilateral filter.
+    int sigma_s = 16;
+    int sigma_r = 32;
+
+    // Size of the rectangular structuring element of the morphology operations.
+    int element_width = 3;
+    int element_height = 3;
+
+    // Size of the thumbnail. A zero dimension keeps the aspect ratio of the image.
+    unsigned int thumb_width = 128;
+    unsigned int thumb_height = 0;
+
+    /*
+     Region of interest as x,y,width,height with y counted from the top of the image.
+     Only the region and the halo the operation reads around it are processed. By default the result is
+     composited back into the untouched image, and with --roi-crop only the region is written.
+    */
+    bool roi = false;
+    bool roi_crop = false;
+    unsigned int roi_x = 0, roi_y = 0, roi_width = 0, roi_height = 0;
+
+    // Low and high thresholds of the canny hysteresis, in the scale of the sobel magnitude.
+    int low_threshold = 20;
+    int high_threshold = 50;
+
+    /*
+     Incremental mode. The images are compared with their previous version in previous_input_path, and only the
+     changed areas of the previous result in previous_output_path are computed again.
+    */
+    bool incremental = false;
+    string previous_input_path;
+    string previous_output_path;
+
+    // Pixels around a region that the operation reads, computed from the rest of options.
+    int halo = 0;
+
+    // Do not log the times of every image, only errors and the summary.
+    bool quiet = false;
+
+    // Write the images as QOI instead of bmp.
+    bool qoi_output = false;
+
+    // Write the images into a bundle at the output path instead of a directory. The bundles of the run are set per run.
+    bool bundle_output = false;
+
+    // The path - reads the images from stdin, or writes them to stdout as frames.
+    bool stream_input = false;
+    bool stream_output = false;
+    const bundle_reader *input_bundle = NULL;
+    bundle_writer *output_bundle = NULL;
+
+    // Process the images as they arrive in the input directory, once they had no events for debounce milliseconds.
+    bool watch = false;
+    int debounce = 100;
+
+    // Process only the files of shard shard_index out of shard_count, split by name hash or by image size.
+    unsigned int shard_index = 0;
+    unsigned int shard_count = 1;
+    bool shard_by_size = false;
+
+    // Directory shared by the workers where every image is claimed before it is processed, and the seconds after
+    // which the claim of a worker that is gone is taken over.
+    string claims;
+    int claim_timeout = 600;
+
+    // File where the totals of the run are written, so that the reports of the shards can be merged.
+    string report_path;
+
+    /*
+     Split every bmp image in tiles of rows that are filtered by as many worker processes. A worker is given its tile
+     with --tile index/count. The coordinator starts the workers with the operation and the options of the run.
+    */
+    int tiles = 1;
+    unsigned int tile_index = 0;
+    unsigned int tile_count = 0;
+    vector<string> tile_arguments;
+};
+
+/*
+ The raw image struct will be converted into an image struct.
+ This struct will be used till the end and contains all the image information.
+*/
+struct image
+{
+    string name;
+    string output_file_path;
+    string input_file_path;
+    unsigned int size;
+    unsigned int width;
+    unsigned int height;
+    unsigned int start_byte;
+    unsigned char raw_header[54];
+    vector<unsigned char> pixels;
+    channel_stats stats[3];
+};
+
+// Time in microseconds spent in the stages of an image that filter_image runs.
+struct stage_times
+{
+    long long decompose;
+    long long gauss;
+    long long sobel;
+    long long recompose;
+    long long stats;
+};
+
+/*
+ Runs the decomposer, the filter and the recomposer (STAGES 3 to 6) over the pixels of an image.
+ The stage times are added to times, so a function call per region of an image adds up.
+*/
+void filter_image(image &img, const options &opt, stage_times &times)
+{
+    auto decompose_start = chrono::high_resolution_clock::now();
+
+    /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                             STAGE 3 --- DECOMPOSER 
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+
+    // Create vectors for storing the decompose image. Sobel-luma only needs the luma plane.
+    unsigned int colour_size = opt.sobel_luma ? 0 : img.height * img.width;
+    vector<unsigned char> blue(colour_size);
+    vector<unsigned char> red(colour_size);
+    vector<unsigned char> green(colour_size);
+    vector<unsigned char> luma(opt.sobel_luma ? img.height * img.width : 0);
+
+    // Calculate the padding the raw image has.
+    int padding = 4 - ((img.width * 3) % 4);
+    if (padding == 4)
+        padding = 0;
+
+    // This width includes the padding.
+    int real_width = img.width * 3 + padding;
+
+    // This part is compulsory in order to be able to apply the filter opeartions.
+    if (opt.gauss || opt.sobel || opt.median || opt.bilateral || opt.morphology || opt.canny || opt.stats)
+    {
+
+        for (unsigned j = 0; j < img.pixels.size(); j++)
+        {
+            // This variables does not count the padding.
+            int real_index = j - ((j / real_width) * padding);
+
+            if (j % real_width >= img.width * 3)
+            {
+                continue;
+            }
+            // Red pixels.
+            else if (real_index % 3 == 0)
+            {
+                red[real_index/3] = (img.pixels[j]);
+            }
+            // Green pixels.
+            else if (real_index % 3 == 1)
+            {
+                green[real_index/3] = (img.pixels[j]);
+            }
+            // Blue pixels.
+            else
+            {
+                blue[real_index/3] = (img.pixels[j]);
+            }
+        }
+    }
+
+    /*
+     Sobel-luma decomposes each pixel into its BT.601 luma in fixed point (weights over 256).
+     BMP pixels are stored as blue, green, red.
+    */
+    if (opt.sobel_luma)
+    {
+        for (int row = 0; row < (int)img.height; row++)
+        {
+            for (int col = 0; col < (int)img.width; col++)
+            {
+                const unsigned char *p = &img.pixels[row * real_width + col * 3];
+                luma[row * img.width + col] = (29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8;
+            }
+        }
+    }
+
+    // The decomposer is included in the load operation.
+    auto decompose_end = chrono::high_resolution_clock::now();
+
+    // The statistics are taken from the planes of the decomposer, before the filter changes them.
+    if (opt.stats)
+    {
+        auto stats_start = chrono::high_resolution_clock::now();
+        plane_stats(red, img.width, img.height, img.stats[0]);
+        plane_stats(green, img.width, img.height, img.stats[1]);
+        plane_stats(blue, img.width, img.height, img.stats[2]);
+        auto stats_end = chrono::high_resolution_clock::now();
+        times.stats += chrono::duration_cast<chrono::microseconds>(stats_end - stats_start).count();
+    }
+
+    /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                         STAGE 4 --- GAUSS OPERATION
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+    auto gauss_start = chrono::high_resolution_clock::now();
+
+    //Gaussian blur matrix.
+    int m[5][5] = {
+        {1, 4, 7, 4, 1},
+        {4, 16, 26, 16, 4},
+        {7, 26, 41, 26, 7},
+        {4, 16, 26, 16, 4},
+        {1, 4, 7, 4, 1}};
+    int weight = 273;
+
+    //Sobel mask matrices.
+    int mx[3][3] = {
+        {1, 2, 1},
+        {0, 0, 0},
+        {-1, -2, -1}};
+
+    int my[3][3] = {
+        {-1, 0, 1},
+        {-2, 0, 2},
+        {-1, 0, 1}};
+    int w = 8;
+
+    // Vector to store changes after gauss operation.
+    vector<unsigned char> red_copy(red.size());
+    vector<unsigned char> blue_copy(blue.size());
+    vector<unsigned char> green_copy(green.size());
+
+    // With a sigma the blur is made of stacked box blurs, whose cost per pixel does not depend on the radius.
+    if ((opt.gauss || opt.sobel || opt.canny) && opt.sigma > 0)
+    {
+        vector<unsigned char> tmp(red.size());
+        gauss_sigma_plane(red, red_copy, tmp, img.width, img.height, opt.sigma);
+        gauss_sigma_plane(blue, blue_copy, tmp, img.width, img.height, opt.sigma);
+        gauss_sigma_plane(green, green_copy, tmp, img.width, img.height, opt.sigma);
+    }
+    // Gauss is executed also if sobel is executed.
+    else if (opt.gauss || opt.canny || (opt.sobel && !opt.fused))
+    {
+        for (int j = 0; j < (int)red.size(); j++)
+        {
+            int col = j % img.width;
+            int row = j / img.width;
+            int result_red = 0;
+            int result_blue = 0;
+            int result_green = 0;
+                    
+            for (int s = -2; s < 3; s++)
+            {
+                for (int t = -2; t < 3; t++)
+                {
+                    // Check that operations outside image are excluded, and therefore treated as if the result was zero.
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
+                    {
+                        result_red += m[s + 3 - 1][t + 3 - 1] * red[(row + s) * img.width + (col + t)];
+                        result_blue += m[s + 3 - 1][t + 3 - 1] * blue[(row + s) * img.width + (col + t)];
+                        result_green += m[s + 3 - 1][t + 3 - 1] * green[(row + s) * img.width + (col + t)];
+                    }
+                }
+            }
+            
+            // The gauss execution results are stored in the <color>_copy vectors.
+            red_copy[j] = result_red / weight;
+            blue_copy[j] = result_blue / weight;
+            green_copy[j] = result_green / weight;
+        }
+    }
+
+    // Sobel-luma blurs only the luma plane.
+    vector<unsigned char> luma_copy(luma.size());
+    if (opt.sobel_luma && opt.sigma > 0)
+    {
+        vector<unsigned char> tmp(luma.size());
+        gauss_sigma_plane(luma, luma_copy, tmp, img.width, img.height, opt.sigma);
+    }
+    else if (opt.sobel_luma && !opt.fused)
+    {
+        gauss_plane(luma, luma_copy, img.width, img.height);
+    }
+
+    // The median results are stored in the <color>_copy vectors, like the gauss ones.
+    if (opt.median)
+    {
+        median_plane(red, red_copy, img.width, img.height, opt.radius);
+        median_plane(blue, blue_copy, img.width, img.height, opt.radius);
+        median_plane(green, green_copy, img.width, img.height, opt.radius);
+    }
+
+    // The bilateral results are stored in the <color>_copy vectors, like the gauss ones.
+    if (opt.bilateral)
+    {
+        bilateral_plane(red, red_copy, img.width, img.height, opt.sigma_s, opt.sigma_r);
+        bilateral_plane(blue, blue_copy, img.width, img.height, opt.sigma_s, opt.sigma_r);
+        bilateral_plane(green, green_copy, img.width, img.height, opt.sigma_s, opt.sigma_r);
+    }
+
+    /*
+     Erode and dilate are a single pass. Open is an erosion followed by a dilation, and close the opposite.
+     The morphology results are stored in the <color>_copy vectors, like the gauss ones.
+    */
+    if (opt.morphology)
+    {
+        vector<unsigned char> *planes[3] = {&red, &blue, &green};
+        vector<unsigned char> *copies[3] = {&red_copy, &blue_copy, &green_copy};
+        for (int p = 0; p < 3; p++)
+        {
+            morph_plane(*planes[p], *copies[p], img.width, img.height, opt.element_width, opt.element_height, opt.dilate || opt.morph_close);
+            if (opt.morph_open || opt.morph_close)
+                morph_plane(*copies[p], *copies[p], img.width, img.height, opt.element_width, opt.element_height, opt.morph_open);
+        }
+    }
+
+    auto gauss_end = chrono::high_resolution_clock::now();
+
+    /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                         STAGE 5 --- SOBEL OPERATION
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+    auto sobel_start = chrono::high_resolution_clock::now();
+
+    // The fused sobel does not need the gauss stage. Its results are stored in the <color>_copy vectors.
+    if (opt.sobel && opt.fused)
+    {
+        sobel_fused_plane(red, red_copy, img.width, img.height);
+        sobel_fused_plane(blue, blue_copy, img.width, img.height);
+        sobel_fused_plane(green, green_copy, img.width, img.height);
+    }
+    else if (opt.sobel)
+    {
+        for (int j = 0; j < (int)red.size(); j++)
+        {
+            int col = j % img.width;
+            int row = j / img.width;
+            int result_red = 0;
+            int result_blue = 0;
+            int result_green = 0;
+
+            // First sobel mask (mx)
+            for (int s = -1; s < 2; s++)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+
+                    // Check that operations outside image are excluded, and therefore treated as if the result was zero.
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
+                    {
+                        result_red += mx[s + 2 - 1][t + 2 - 1] * red_copy[(row + s) * img.width + (col + t)];
+                        result_blue += mx[s + 2 - 1][t + 2 - 1] * blue_copy[(row + s) * img.width + (col + t)];
+                        result_green += mx[s + 2 - 1][t + 2 - 1] * green_copy[(row + s) * img.width + (col + t)];
+                    }
+                }
+            }
+
+            float res_x_red = (float) result_red /(float)  w;
+            float res_x_blue = (float) result_blue / (float) w;
+            float res_x_green = (float) result_green / (float) w;
+
+            result_red = 0;
+            result_blue = 0;
+            result_green = 0;
+
+            // Second sobel mask (my)
+            for (int s = -1; s < 2; s++)
+            {
+                for (int t = -1; t < 2; t++)
+                {
+
+                    // Check that operations outside image are excluded, and therefore treated as if the result was zero.
+                    if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
+                    {
+                        result_red += my[s + 2 - 1][t + 2 - 1] * red_copy[(row + s) * img.width + (col + t)];
+                        result_blue += my[s + 2 - 1][t + 2 - 1] * blue_copy[(row + s) * img.width + (col + t)];
+                        result_green += my[s + 2 - 1][t + 2 - 1] * green_copy[(row + s) * img.width + (col + t)];
+                    }
+                }
+            }
+
+            float res_y_red = (float)result_red / (float)w;
+            float res_y_blue = (float)result_blue / (float)w;
+            float res_y_green = (float)result_green / (float)w;
+
+            // The results of sobel are stored in the original vector, unlike the gauss ones.
+            red[j] = static_cast<unsigned int>(abs(res_y_red) + abs(res_x_red));
+            blue[j] = static_cast<unsigned int>(abs(res_y_green) + abs(res_x_green));
+            green[j] = static_cast<unsigned int>(abs(res_y_blue) + abs(res_x_blue));
+        }
+    }
+
+    // As with the colour planes, the sobel result of the luma is stored in the original vector.
+    if (opt.sobel_luma && opt.fused)
+    {
+        sobel_fused_plane(luma, luma, img.width, img.height);
+    }
+    else if (opt.sobel_luma)
+    {
+        sobel_plane(luma_copy, luma, img.width, img.height);
+    }
+
+    // Canny starts from the blurred planes, and its results are stored in the original vectors like the sobel ones.
+    if (opt.canny)
+    {
+        canny_plane(red_copy, red, img.width, img.height, opt.low_threshold, opt.high_threshold);
+        canny_plane(blue_copy, blue, img.width, img.height, opt.low_threshold, opt.high_threshold);
+        canny_plane(green_copy, green, img.width, img.height, opt.low_threshold, opt.high_threshold);
+    }
+
+    auto sobel_end = chrono::high_resolution_clock::now();
+
+    /*      .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                         STAGE 6 --- RECOMPOSER 
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+
+    // The recomposer time is considered to be part of the store time.
+    auto recompose_start = chrono::high_resolution_clock::now();
+    
+    /*
+     This vectors point to the vector that contain the results that will be recomposed.
+     This was done to improve both performance and code legibility.
+    */
+
+    vector<unsigned char> *red_result = NULL;
+    vector<unsigned char> *green_result = NULL;
+    vector<unsigned char> *blue_result = NULL;
+
+    /* Since sobel results are stored in the original vectors and gauss results are stored in the <color>_copy vectors.
+     Pointers are used to get to the gauss results in _copy vectors (distinct from sobel ones).
+    */
+
+    if (opt.gauss || opt.median || opt.bilateral || opt.morphology){
+        red_result = &red_copy;
+        green_result = &green_copy;
+        blue_result = &blue_copy;
+    }
+
+    // Pointers are used to get to the gauss results in original  vectors (distinct from gauss ones).
+    if(opt.sobel){ 
+        red_result = &red;
+        green_result = &blue;
+        blue_result = &green;
+    }
+
+    if (opt.canny)
+    {
+        red_result = &red;
+        green_result = &green;
+        blue_result = &blue;
+    }
+
+    // The fused sobel results are in the <color>_copy vectors, in the same order as the gauss ones.
+    if (opt.sobel && opt.fused)
+    {
+        red_result = &red_copy;
+        green_result = &green_copy;
+        blue_result = &blue_copy;
+    }
+
+    // Recomposition is performed and merges the three colour vectors into the original image pixels vector that was decomposed.
+    if (opt.gauss || opt.sobel || opt.median || opt.bilateral || opt.morphology || opt.canny)
+    {
+        
+        // The j index in this loop takes into account the padding.
+        for (unsigned j = 0; j < img.pixels.size(); j++)
+        {
+            // This variable accounts for the pixel number without taking into account padding.
+            int real_index = j - ((j / real_width) * padding);
+
+            if (j % real_width >= img.width * 3)
+            {
+                continue;
+            }
+            // Red pixels.
+            else if (real_index % 3 == 0)
+            {
+                img.pixels[j] = (*red_result)[real_index/3];
+            }
+            // Green pixels.
+            else if (real_index % 3 == 1)
+            {
+                img.pixels[j] = (*green_result)[real_index/3];
+            }
+            // Blue pixels.
+            else
+            {
+                img.pixels[j] = (*blue_result)[real_index/3];
+            }
+        }
+        
+    }
+
+    // Sobel-luma writes the same edge magnitude in the three bytes of every pixel.
+    if (opt.sobel_luma)
+    {
+        for (int row = 0; row < (int)img.height; row++)
+        {
+            for (int col = 0; col < (int)img.width; col++)
+            {
+                unsigned char *p = &img.pixels[row * real_width + col * 3];
+                p[0] = p[1] = p[2] = luma[row * img.width + col];
+            }
+        }
+    }
+
+    auto recompose_end = chrono::high_resolution_clock::now();
+
+    times.decompose += chrono::duration_cast<chrono::microseconds>(decompose_end - decompose_start).count();
+    times.gauss += chrono::duration_cast<chrono::microseconds>(gauss_end - gauss_start).count();
+    times.sobel += chrono::duration_cast<chrono::microseconds>(sobel_end - sobel_start).count();
+    times.recompose += chrono::duration_cast<chrono::microseconds>(recompose_end - recompose_start).count();
+}
+
+/*
+ Parses the operation in argv[1] and the options after the paths into opt, and sets the halo of the operation.
+ The errors are written to err. Returns false if the command is not valid.
+*/
+bool parse_options(int argc, char **argv, options &opt, ostream &err)
+{
+    /*
+     The operation can start with geometric transforms separated by commas, and ends with at most one filter.
+     For example rotate90,flip-h,sobel. Without a filter the transformed image is copied.
+     A thumbnail step may come before everything else, e.g. thumbnail,sobel.
+     A stats step may come before the filter, e.g. stats,sobel, or alone to only copy the image.
+    */
+    bool valid_operation = true;
+    string chain = argv[1];
+    size_t chain_start = 0;
+    while (chain_start <= chain.size())
+    {
+        size_t chain_end = chain.find(',', chain_start);
+        if (chain_end == string::npos)
+            chain_end = chain.size();
+        string step = chain.substr(chain_start, chain_end - chain_start);
+        chain_start = chain_end + 1;
+
+        bool last_step = chain_start > chain.size();
+        if (step == "thumbnail" && opt.transforms.empty() && !opt.thumbnail)
+            opt.thumbnail = true;
+        else if (step == "stats" && !opt.stats)
+            opt.stats = true;
+        else if (step == "rotate90" || step == "rotate180" || step == "rotate270" || step == "flip-h" || step == "flip-v")
+            opt.transforms.push_back(step);
+        else if (last_step)
+            opt.operation = step;
+        else
+            valid_operation = false;
+    }
+
+    // If the filter is not one of the operations, stop execution.
+    if (!valid_operation || (opt.operation != "copy" && opt.operation != "gauss" && opt.operation != "sobel" && opt.operation != "sobel-luma" && opt.operation != "median" && opt.operation != "bilateral" &&
+        opt.operation != "erode" && opt.operation != "dilate" && opt.operation != "open" && opt.operation != "close" && opt.operation != "canny"))
+    {
+        err << "Unexpected operation: " << argv[1] << "\n"
+             << "image-seq operation in_path out path\n "
+             << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+             << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+             << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+             << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
+        return false;
+    }
+
+    // Extract the required operation.
+    opt.gauss = opt.operation == "gauss";
+    opt.sobel = opt.operation == "sobel";
+    opt.sobel_luma = opt.operation == "sobel-luma";
+    opt.median = opt.operation == "median";
+    opt.bilateral = opt.operation == "bilateral";
+    opt.erode = opt.operation == "erode";
+    opt.dilate = opt.operation == "dilate";
+    opt.morph_open = opt.operation == "open";
+    opt.morph_close = opt.operation == "close";
+    opt.morphology = opt.erode || opt.dilate || opt.morph_open || opt.morph_close;
+    opt.canny = opt.operation == "canny";
+
+    // Parse the options that follow the paths.
+    for (int a = 4; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--sigma") == 0 && a + 1 < argc)
+        {
+            opt.sigma = atof(argv[++a]);
+            if (opt.sigma <= 0)
+            {
+                err << "Sigma must be greater than zero: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--fused") == 0)
+        {
+            opt.fused = true;
+        }
+        else if ((strcmp(argv[a], "--sigma-s") == 0 || strcmp(argv[a], "--sigma-r") == 0) && a + 1 < argc)
+        {
+            int value = atoi(argv[a + 1]);
+            if (value < 1 || value > 255)
+            {
+                err << argv[a] << " must be between 1 and 255: " << argv[a + 1] << "\n";
+                return false;
+            }
+            if (strcmp(argv[a], "--sigma-s") == 0)
+                opt.sigma_s = value;
+            else
+                opt.sigma_r = value;
+            a++;
+        }
+        else if (strcmp(argv[a], "--element") == 0 && a + 1 < argc)
+        {
+            if (sscanf(argv[++a], "%dx%d", &opt.element_width, &opt.element_height) != 2 || opt.element_width < 1 || opt.element_height < 1)
+            {
+                err << "Element must be widthxheight, for example 5x3: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--thresholds") == 0 && a + 1 < argc)
+        {
+            if (sscanf(argv[++a], "%d,%d", &opt.low_threshold, &opt.high_threshold) != 2 || opt.low_threshold < 1 || opt.low_threshold > opt.high_threshold)
+            {
+                err << "Thresholds must be low,high with 1 <= low <= high: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--size") == 0 && a + 1 < argc)
+        {
+            if (sscanf(argv[++a], "%ux%u", &opt.thumb_width, &opt.thumb_height) != 2 || (opt.thumb_width == 0 && opt.thumb_height == 0))
+            {
+                err << "Size must be widthxheight, with at most one of them zero: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--roi") == 0 && a + 1 < argc)
+        {
+            opt.roi = true;
+            if (sscanf(argv[++a], "%u,%u,%u,%u", &opt.roi_x, &opt.roi_y, &opt.roi_width, &opt.roi_height) != 4 || opt.roi_width == 0 || opt.roi_height == 0)
+            {
+                err << "Region of interest must be x,y,width,height: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--incremental") == 0 && a + 2 < argc)
+        {
+            opt.incremental = true;
+            opt.previous_input_path = argv[++a];
+            opt.previous_output_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "--quiet") == 0)
+        {
+            opt.quiet = true;
+        }
+        else if (strcmp(argv[a], "--format") == 0 && a + 1 < argc)
+        {
+            a++;
+            if (strcmp(argv[a], "qoi") == 0)
+                opt.qoi_output = true;
+            else if (strcmp(argv[a], "bmp") != 0)
+            {
+                err << "Format must be bmp or qoi: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--bundle") == 0)
+        {
+            opt.bundle_output = true;
+        }
+        else if (strcmp(argv[a], "--watch") == 0)
+        {
+            opt.watch = true;
+        }
+        else if (strcmp(argv[a], "--debounce") == 0 && a + 1 < argc)
+        {
+            opt.debounce = atoi(argv[++a]);
+            if (opt.debounce < 1)
+            {
+                err << "Debounce must be at least one millisecond: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--shard") == 0 && a + 1 < argc)
+        {
+            char slash;
+            istringstream shard(argv[++a]);
+            if (!(shard >> opt.shard_index >> slash >> opt.shard_count) || slash != '/' || !shard.eof() ||
+                opt.shard_count < 1 || opt.shard_index >= opt.shard_count)
+            {
+                err << "Shard must be index/count with index below count: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--shard-by") == 0 && a + 1 < argc)
+        {
+            a++;
+            if (strcmp(argv[a], "hash") != 0 && strcmp(argv[a], "size") != 0)
+            {
+                err << "Shards are split by hash or size: " << argv[a] << "\n";
+                return false;
+            }
+            opt.shard_by_size = strcmp(argv[a], "size") == 0;
+        }
+        else if (strcmp(argv[a], "--claim") == 0 && a + 1 < argc)
+        {
+            opt.claims = argv[++a];
+        }
+        else if (strcmp(argv[a], "--claim-timeout") == 0 && a + 1 < argc)
+        {
+            opt.claim_timeout = atoi(argv[++a]);
+            if (opt.claim_timeout < 1)
+            {
+                err << "Claim timeout must be at least one second: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--tiles") == 0 && a + 1 < argc)
+        {
+            opt.tiles = atoi(argv[++a]);
+            if (opt.tiles < 1 || opt.tiles > 256)
+            {
+                err << "Tiles must be between 1 and 256: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--tile") == 0 && a + 1 < argc)
+        {
+            char slash;
+            istringstream tile(argv[++a]);
+            if (!(tile >> opt.tile_index >> slash >> opt.tile_count) || slash != '/' || !tile.eof() ||
+                opt.tile_count < 1 || opt.tile_index >= opt.tile_count)
+            {
+                err << "Tile must be index/count with index below count: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else if (strcmp(argv[a], "--report") == 0 && a + 1 < argc)
+        {
+            opt.report_path = argv[++a];
+        }
+        else if (strcmp(argv[a], "--roi-crop") == 0)
+        {
+            opt.roi_crop = true;
+        }
+        else if (strcmp(argv[a], "--radius") == 0 && a + 1 < argc)
+        {
+            opt.radius = atoi(argv[++a]);
+            if (opt.radius < 1 || opt.radius > 127)
+            {
+                err << "Radius must be between 1 and 127: " << argv[a] << "\n";
+                return false;
+            }
+        }
+        else
+        {
+            err << "Unexpected option: " << argv[a] << "\n"
+                 << "image-seq operation in_path|- out_path|- [--sigma value] [--fused] [--radius n] [--sigma-s n] [--sigma-r n] [--element wxh] [--thresholds low,high] [--size wxh] [--roi x,y,w,h] [--roi-crop] [--incremental prev_in prev_out] [--format bmp|qoi] [--bundle] [--quiet] [--watch] [--debounce ms] [--shard i/N] [--shard-by hash|size] [--claim dir] [--claim-timeout s] [--report file] [--tiles n]\n"
+                 << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+                 << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+                 << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+                 << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
+            return false;
+        }
+    }
+
+    // The fused sobel has its own fixed blur, so it cannot be combined with a sigma.
+    if (opt.fused && opt.sigma > 0)
+    {
+        err << "The options --fused and --sigma cannot be used together\n";
+        return false;
+    }
+
+    // The stats step reads the colour planes of the whole image, before a filter that keeps them.
+    if (opt.stats && opt.operation != "copy" && opt.operation != "gauss" && opt.operation != "sobel")
+    {
+        err << "The stats step can only be combined with gauss or sobel\n";
+        return false;
+    }
+    if (opt.stats && (opt.roi || opt.incremental || opt.tiles > 1))
+    {
+        err << "The stats step cannot be used with --roi, --incremental or --tiles\n";
+        return false;
+    }
+
+    if (opt.roi_crop && !opt.roi)
+    {
+        err << "The option --roi-crop needs --roi\n";
+        return false;
+    }
+
+    // The watch mode processes the files of a directory as they arrive.
+    if (opt.watch && opt.bundle_output)
+    {
+        err << "The options --watch and --bundle cannot be used together\n";
+        return false;
+    }
+
+    // A path - is stdin for the input and stdout for the output.
+    opt.stream_input = strcmp(argv[2], "-") == 0;
+    opt.stream_output = strcmp(argv[3], "-") == 0;
+    if (opt.watch && (opt.stream_input || opt.stream_output))
+    {
+        err << "The option --watch needs an input and an output directory\n";
+        return false;
+    }
+
+    // The workers split the list of files of an input directory or bundle, which stdin and watch mode do not have.
+    if ((opt.shard_count > 1 || !opt.claims.empty()) && (opt.watch || opt.stream_input))
+    {
+        err << "The options --shard and --claim need an input directory or bundle\n";
+        return false;
+    }
+
+    // The tiles are filtered with the halo of the operation, which is only exact for the local filters.
+    if (opt.tiles > 1 && (opt.bilateral || opt.canny || opt.thumbnail || !opt.transforms.empty() || opt.roi || opt.incremental))
+    {
+        err << "The option --tiles cannot be used with bilateral, canny, thumbnail, transforms, --roi or --incremental\n";
+        return false;
+    }
+
+    // The workers read and write the rows of their tile at the offsets of the bmp files.
+    if (opt.tiles > 1 && (opt.qoi_output || opt.bundle_output || opt.watch || opt.stream_input || opt.stream_output))
+    {
+        err << "The option --tiles needs bmp files in an input and an output directory\n";
+        return false;
+    }
+
+    // The workers of the tiles get the operation and the options of the run, without --tiles.
+    opt.tile_arguments.assign(1, argv[1]);
+    for (int a = 4; a < argc; a++)
+    {
+        if (strcmp(argv[a], "--tiles") == 0)
+            a++;
+        else
+            opt.tile_arguments.push_back(argv[a]);
+    }
+
+    // The previous images can only be compared with the new ones pixel by pixel.
+    if (opt.incremental && (opt.roi || opt.thumbnail || !opt.transforms.empty()))
+    {
+        err << "The option --incremental cannot be used with --roi, thumbnail or transforms\n";
+        return false;
+    }
+
+    // The patched areas are filtered with the halo of the operation, which is only exact for the local filters.
+    if (opt.incremental && (opt.bilateral || opt.canny))
+    {
+        err << "The option --incremental cannot be used with bilateral or canny\n";
+        return false;
+    }
+
+    /*
+     Pixels around the region of interest that the operation reads, so the region gets the same result as in the
+     full image. The blur reaches 2 pixels (or the three box radii with a sigma) and sobel one more.
+     Bilateral and the hysteresis of canny are not local, so for them the halo is an approximation.
+    */
+    int blur_halo = 2;
+    if (opt.sigma > 0)
+    {
+        int sizes[3];
+        gauss_box_sizes(opt.sigma, sizes);
+        blur_halo = (sizes[0] - 1) / 2 + (sizes[1] - 1) / 2 + (sizes[2] - 1) / 2;
+    }
+    if (opt.gauss)
+        opt.halo = blur_halo;
+    else if (opt.sobel || opt.sobel_luma)
+        opt.halo = opt.fused ? 3 : blur_halo + 1;
+    else if (opt.median)
+        opt.halo = opt.radius;
+    else if (opt.bilateral)
+        opt.halo = 4 * opt.sigma_s;
+    else if (opt.morphology)
+        opt.halo = max(opt.element_width, opt.element_height) / 2 * ((opt.morph_open || opt.morph_close) ? 2 : 1);
+    else if (opt.canny)
+        opt.halo = blur_halo + 2;
+
+    return true;
+}
+
+/*
+ Totals of a run over a directory: the images written, the files rejected by the header checks
+ and the time of every stage added over all the images.
+*/
+struct job_report
+{
+    unsigned int images;
+    unsigned int skipped_files;
+    unsigned long long skipped_bytes;
+    long long load_time;
+    long long gauss_time;
+    long long sobel_time;
+    long long store_time;
+};
+
+/*
+ Worker of a tiled image (--tile index/count). Filters the rows of tile index out of count of the bmp in_file, with
+ the halo rows of the operation around them, and writes the rows of the tile at their offset of out_file, which the
+ coordinator created with its header and its full size. The rows are in stored order, from the bottom of the image.
+ The load, filter and store times in microseconds are written to stdout for the coordinator. Returns the exit code.
+*/
+int filter_tile(const string &in_file, const string &out_file, const options &opt)
+{
+    auto load_start = chrono::high_resolution_clock::now();
+
+    int input = open(in_file.c_str(), O_RDONLY);
+    int output = open(out_file.c_str(), O_WRONLY);
+    unsigned char header[54];
+    if (input < 0 || output < 0 || pread(input, header, 54, 0) != 54 || header[0] != 'B' || header[1] != 'M')
+    {
+        cerr << "Tile " << opt.tile_index << " cannot read " << in_file << " or write " << out_file << "\n";
+        if (input >= 0)
+            close(input);
+        if (output >= 0)
+            close(output);
+        return 1;
+    }
+    image img;
+    img.width = get_number(header + 18, 4);
+    img.height = get_number(header + 22, 4);
+    img.start_byte = get_number(header + 10, 4);
+    unsigned long long stride = (3ULL * img.width + 3) / 4 * 4;
+
+    // Rows of the tile, and of the tile with its halo clipped at the borders of the image.
+    unsigned int first = (unsigned long long)img.height * opt.tile_index / opt.tile_count;
+    unsigned int last = (unsigned long long)img.height * (opt.tile_index + 1) / opt.tile_count;
+    unsigned int halo_first = first > (unsigned int)opt.halo ? first - opt.halo : 0;
+    unsigned int halo_last = min(img.height, last + opt.halo);
+
+    img.height = halo_last - halo_first;
+    img.pixels.resize(stride * img.height);
+    bool loaded = pread(input, &img.pixels[0], img.pixels.size(), img.start_byte + stride * halo_first) == (ssize_t)img.pixels.size();
+    close(input);
+    if (!loaded)
+    {
+        cerr << "Tile " << opt.tile_index << " cannot read the rows of " << in_file << "\n";
+        close(output);
+        return 1;
+    }
+    auto load_end = chrono::high_resolution_clock::now();
+
+    stage_times times = {0, 0, 0, 0, 0};
+    filter_image(img, opt, times);
+
+    // Only the rows of the tile are written, without the halo.
+    auto store_start = chrono::high_resolution_clock::now();
+    size_t tile_bytes = stride * (last - first);
+    bool stored = pwrite(output, &img.pixels[stride * (first - halo_first)], tile_bytes, 54 + stride * first) == (ssize_t)tile_bytes;
+    close(output);
+    if (!stored)
+    {
+        cerr << "Tile " << opt.tile_index << " cannot write the rows of " << out_file << "\n";
+        return 1;
+    }
+    auto store_end = chrono::high_resolution_clock::now();
+
+    cout << chrono::duration_cast<chrono::microseconds>(load_end - load_start).count() + times.decompose << " "
+         << times.gauss << " " << times.sobel << " "
+         << chrono::duration_cast<chrono::microseconds>(store_end - store_start).count() + times.recompose << endl;
+    return 0;
+}
+
+// Label of the filter stage in the log of an image.
+const char *filter_label(const options &opt)
+{
+    return opt.median ? "Median time: " : opt.bilateral ? "Bilateral time: " : opt.morphology ? "Morphology time: " : "Gauss time: ";
+}
+
+// Label of the edge stage in the log of an image.
+const char *edge_label(const options &opt)
+{
+    return opt.canny ? "Canny time: " : "Sobel time: ";
+}
+
+/*
+ Coordinator of a tiled image. Creates the output file with its header and its full size, and starts a worker
+ process per tile on this machine. The workers are this program with the command line of the run, the files of the
+ image and --tile index/count. Their times are added to the totals of the image. The pixels of the image are never
+ loaded by the coordinator.
+*/
+void process_tiles(const image &img, const options &opt, chrono::high_resolution_clock::time_point global_start, string &record, job_report &report)
+{
+    unsigned int stride = (img.width * 3 + 3) / 4 * 4;
+    unsigned int pixel_bytes = stride * img.height;
+
+    // The same header that STAGE 7 writes.
+    string header = "BM";
+    put_number(header, 54 + pixel_bytes, 4);
+    put_number(header, 0, 4);
+    put_number(header, 54, 4);
+    put_number(header, 40, 4);
+    put_number(header, img.width, 4);
+    put_number(header, img.height, 4);
+    put_number(header, 1, 2);
+    put_number(header, 24, 2);
+    put_number(header, 0, 4);
+    put_number(header, pixel_bytes, 4);
+    put_number(header, 2835, 4);
+    put_number(header, 2835, 4);
+    put_number(header, 0, 8);
+
+    int output = open(img.output_file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool created = output >= 0 && write(output, header.data(), header.size()) == (ssize_t)header.size() && ftruncate(output, 54 + (off_t)pixel_bytes) == 0;
+    if (output >= 0)
+        close(output);
+    if (!created)
+    {
+        print_error(record, img.output_file_path, " cannot be created");
+        return;
+    }
+
+    // The workers write their times into a pipe that is closed in any other process this one starts.
+    int times_pipe[2];
+    if (pipe2(times_pipe, O_CLOEXEC) != 0)
+    {
+        print_error(record, img.output_file_path, " cannot start the tile workers");
+        return;
+    }
+    vector<pid_t> workers;
+    for (int t = 0; t < opt.tiles; t++)
+    {
+        // The arguments are built before the fork, so the worker only has to exec.
+        vector<string> arguments = opt.tile_arguments;
+        arguments.insert(arguments.begin() + 1, img.input_file_path);
+        arguments.insert(arguments.begin() + 2, img.output_file_path);
+        arguments.push_back("--tile");
+        arguments.push_back(to_string(t) + "/" + to_string(opt.tiles));
+        vector<char *> worker_argv(1, (char *)"/proc/self/exe");
+        for (unsigned int k = 0; k < arguments.size(); k++)
+            worker_argv.push_back(&arguments[k][0]);
+        worker_argv.push_back(NULL);
+
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            dup2(times_pipe[1], STDOUT_FILENO);
+            execv("/proc/self/exe", worker_argv.data());
+            _exit(127);
+        }
+        if (pid > 0)
+            workers.push_back(pid);
+    }
+    close(times_pipe[1]);
+
+    // Every worker writes a line with its times before it exits.
+    string lines;
+    char buffer[256];
+    ssize_t count;
+    while ((count = read(times_pipe[0], buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR))
+        if (count > 0)
+            lines.append(buffer, count);
+    close(times_pipe[0]);
+
+    bool failed = (int)workers.size() != opt.tiles;
+    for (unsigned int k = 0; k < workers.size(); k++)
+    {
+        int status;
+        while (waitpid(workers[k], &status, 0) < 0 && errno == EINTR)
+            ;
+        failed = failed || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    if (failed)
+    {
+        print_error(record, img.output_file_path, " tile worker failed");
+        return;
+    }
+
+    long long load_time = 0, gauss_time = 0, sobel_time = 0, store_time = 0;
+    istringstream worker_times(lines);
+    long long load, gauss, sobel, store;
+    while (worker_times >> load >> gauss >> sobel >> store)
+    {
+        load_time += load;
+        gauss_time += gauss;
+        sobel_time += sobel;
+        store_time += store;
+    }
+    auto global_end = chrono::high_resolution_clock::now();
+    auto global_time = chrono::duration_cast<chrono::microseconds>(global_end - global_start).count();
+
+    report.images++;
+    report.load_time += load_time;
+    report.gauss_time += gauss_time;
+    report.sobel_time += sobel_time;
+    report.store_time += store_time;
+
+    // The stage times are added over the tiles, so with the tiles running at once they are larger than the time of the image.
+    if (!opt.quiet)
+    {
+        ostringstream log;
+        log << "File: " << img.input_file_path << " (time: " << global_time << ")\n";
+        log << "Load time: " << load_time << "\n";
+        log << filter_label(opt) << gauss_time << "\n";
+        log << edge_label(opt) << sobel_time << "\n";
+        log << "Store time: " << store_time << "\n";
+        log << "Tiles: " << opt.tiles << "\n";
+        log << "\n";
+        record += log.str();
+    }
+}
+
+/*
+ Statistics of an image as JSON, for the stats step. The planes are named as in the decomposer, but the first byte of
+ a bmp pixel is blue, so the channels of the JSON take the colours of the bytes.
+*/
+string stats_json(const image &img)
+{
+    const char *channels[3] = {"blue", "green", "red"};
+    ostringstream json;
+    json << "{\"image\": \"";
+    for (char c : img.name)
+    {
+        if (c == '"' || c == '\\')
+            json << '\\';
+        json << c;
+    }
+    json << "\", \"width\": " << img.width << ", \"height\": " << img.height << ", \"channels\": {";
+    for (int p = 0; p < 3; p++)
+    {
+        const channel_stats &stats = img.stats[p];
+        json << (p > 0 ? ", " : "") << "\"" << channels[p] << "\": {\"min\": " << stats.min << ", \"max\": " << stats.max
+             << ", \"mean\": " << stats.mean << ", \"sharpness\": " << stats.sharpness << ", \"histogram\": [";
+        for (int k = 0; k < 256; k++)
+            json << (k > 0 ? ", " : "") << stats.histogram[k];
+        json << "]}";
+    }
+    json << "}}\n";
+    return json.str();
+}
+
+/*
+ Loads, filters and stores the image name of in_path into out_path (STAGES 2 to 7). Its log lines are added to record
+ and its totals to report. arrival is when the image was found, the start of the time until its output.
+*/
+void process_file(const string &in_path, const string &out_path, const string &name, chrono::high_resolution_clock::time_point arrival,
+                  const options &opt, string &record, job_report &report)
+{
+    /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                         STAGE 2 --- IMAGE EXTRACTION 
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+
+    // Struct to store extracted picture.
+    struct raw_image
+    {
+        string name;
+        string output_file_path;
+        string input_file_path;
+        vector<char> raw_data;
+    };
+
+    // Start the total time counter per image.
+    auto global_start = chrono::high_resolution_clock::now();
+    // Start counter for the load phase.
+    auto load_start = chrono::high_resolution_clock::now();
+
+    // Get the path of the file.
+    std::string input_file_path = in_path;
+    std::string output_file_path = out_path;
+
+    // Check if the path has the last slash.
+    if (input_file_path.back() != '/')
+        input_file_path.append("/");
+    if (output_file_path.back() != '/')
+        output_file_path.append("/");
+
+    // Add the target image name to the path.
+    input_file_path += name;
+    output_file_path += name;
+
+    // The output takes the extension of its format. A bmp output keeps the name of an input that is not a .qoi file.
+    size_t dot = name.rfind('.');
+    bool qoi_name = dot != string::npos && name.compare(dot, string::npos, ".qoi") == 0;
+    if (opt.qoi_output || qoi_name)
+    {
+        if (dot != string::npos && dot > 0)
+            output_file_path.erase(output_file_path.size() - (name.size() - dot));
+        output_file_path += opt.qoi_output ? ".qoi" : ".bmp";
+    }
+
+    /*
+     Get the size of the file by moving the file pointer at the end.
+     An image of an input bundle is read from the mapped bundle instead, without opening a file.
+    */
+    ifstream input_file;
+    memory_buffer bundle_bytes;
+    istream bundle_stream(&bundle_bytes);
+    istream &ifs = opt.input_bundle != NULL ? bundle_stream : input_file;
+    ifstream::pos_type size;
+    if (opt.input_bundle != NULL)
+    {
+        const bundle_entry &entry = opt.input_bundle->entries[opt.input_bundle->positions.at(name)];
+        bundle_bytes.assign(opt.input_bundle->data + entry.offset, entry.size);
+        size = entry.size;
+    }
+    else
+    {
+        input_file.open(input_file_path, ios::binary | ios::ate);
+        size = input_file.tellg();
+    }
+
+    // Create the raw image structure.
+    raw_image raw_img;
+
+    // Set the original file name.
+    raw_img.output_file_path = output_file_path;
+    raw_img.input_file_path = input_file_path;
+    raw_img.name = name;
+
+    /*
+     The raw image struct will be converted into an image struct.
+     This struct will be used till the end and contains all the image information.
+    */
+
+    image img;
+
+    // Copy values from raw image to the new struct.
+    img.output_file_path = raw_img.output_file_path;
+    img.input_file_path = raw_img.input_file_path;
+    img.name = raw_img.name;
+
+    // Size of the pixel array, with the rows padded to four bytes.
+    unsigned long long pixel_bytes = 0;
+
+    /*
+     A QOI image is recognized by its magic bytes. Its header only has the size of the image, and its pixels are
+     decoded into the same pixel array as the ones of a bmp file.
+    */
+    char magic[4] = {0, 0, 0, 0};
+    ifs.seekg(0, ios::beg);
+    bool qoi_input = size >= 22 && ifs.read(magic, 4) && memcmp(magic, "qoif", 4) == 0;
+    if (qoi_input)
+    {
+        unsigned char qoi_header[10];
+        ifs.read((char *)qoi_header, 10);
+        img.width = ((unsigned int)qoi_header[0] << 24) + (qoi_header[1] << 16) + (qoi_header[2] << 8) + qoi_header[3];
+        img.height = ((unsigned int)qoi_header[4] << 24) + (qoi_header[5] << 16) + (qoi_header[6] << 8) + qoi_header[7];
+
+        // The format limits an image to 400 million pixels, with three or four channels.
+        if (img.width == 0 || img.height == 0 || (unsigned long long)img.width * img.height > 400000000 || (qoi_header[8] != 3 && qoi_header[8] != 4))
+        {
+            print_error(record, img.output_file_path, " is not a valid qoi file");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+        pixel_bytes = (3ULL * img.width + 3) / 4 * 4 * img.height;
+    }
+    else
+    {
+        /*
+         Only the 54 byte header is read into the raw image.
+         The pixel data is not touched until the header has been validated.
+        */
+        ifs.seekg(0, ios::beg);
+        raw_img.raw_data.resize(54);
+        if (size < 54 || !ifs.read(&raw_img.raw_data[0], 54))
+        {
+            print_error(record, output_file_path, " is too small to be a bmp file");
+            report.skipped_files++;
+            if (size > 0)
+                report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+
+        // Chech that images have BM header. Stop if they do not.
+        if (!(raw_img.raw_data[0] == 'B' && raw_img.raw_data[1] == 'M'))
+        {
+            print_error(record, img.output_file_path, " is not a bmp file");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+
+        // Get the number of planes.
+        unsigned int num_planes = (((unsigned int)(unsigned char)raw_img.raw_data[27]) << 8) + (unsigned int)(unsigned char)raw_img.raw_data[26];
+
+        // Get the point size.
+        unsigned int point_size = (((unsigned int)(unsigned char)raw_img.raw_data[29]) << 8) + (unsigned int)(unsigned char)raw_img.raw_data[28];
+
+        // Get the compression variable.
+        unsigned int compression = (((unsigned int)(unsigned char)raw_img.raw_data[33]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[32]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[31]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[30]);
+
+        // Check number of planes is one.
+        if (num_planes != 1)
+        {
+            print_error(record, img.output_file_path, " has more than one plane");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+
+        // Check point size is 24.
+        if (point_size != 24)
+        {
+            print_error(record, img.output_file_path, " does not have 24 bits");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+        
+        // Check the image compression is zero.
+        if (compression != 0)
+        {
+            print_error(record, img.output_file_path, " compression is different from 0");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+
+        // Get the image width.
+        img.width = (((unsigned int)(unsigned char)raw_img.raw_data[21]) << 24)
+                    + (((unsigned int)(unsigned char)raw_img.raw_data[20]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[19]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[18]);
+
+        // Get the height of the image.
+        img.height = (((unsigned int)(unsigned char)raw_img.raw_data[25]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[24]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[23]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[22]);
+
+        // Get the image start of data.
+        img.start_byte = (((unsigned int)(unsigned char)raw_img.raw_data[13]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[12]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[11]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[10]);
+
+        /*
+         Check the size of the image before anything is sized from it. The limit is the one of QOI images, so the
+         planes and their offsets fit in 32 bits.
+        */
+        if (img.width == 0 || img.height == 0 || (unsigned long long)img.width * img.height > 400000000)
+        {
+            print_error(record, img.output_file_path, " width or height is 0 or too large");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+
+        // Check the pixel array (rows are padded to four bytes) fits between the start of data and the end of the file.
+        // The file size in the header is not checked, as some writers leave it wrong.
+        pixel_bytes = (3ULL * img.width + 3) / 4 * 4 * img.height;
+        if (img.start_byte < 54 || img.start_byte + pixel_bytes > (unsigned long long)size)
+        {
+            print_error(record, img.output_file_path, " pixel data does not fit in the file");
+            report.skipped_files++;
+            report.skipped_bytes += (unsigned long long)size;
+            return;
+        }
+    }
+
+    // An image of the input directory split in tiles is filtered by worker processes. The image of a bundle is not a file they can read.
+    if (opt.tiles > 1 && !qoi_input && opt.input_bundle == NULL)
+    {
+        process_tiles(img, opt, global_start, record, report);
+        return;
+    }
+
+    // A QOI image is decoded whole, and then read like the pixel array of a bmp file.
+    if (qoi_input)
+    {
+        vector<unsigned char> data((unsigned long long)size - 14);
+        ifs.seekg(14, ios::beg);
+        ifs.read((char *)&data[0], data.size());
+        if (!decode_qoi(data, img.width, img.height, img.pixels))
+        {
+            print_error(record, img.output_file_path, " qoi data ends before the last pixel");
+            return;
+        }
+    }
+
+    // A thumbnail is reduced while the rows are read. The image is never larger than the original.
+    if (opt.thumbnail)
+    {
+        unsigned int target_width = opt.thumb_width;
+        unsigned int target_height = opt.thumb_height;
+        if (target_width == 0)
+            target_width = max(1ULL, ((unsigned long long)img.width * target_height + img.height / 2) / img.height);
+        if (target_height == 0)
+            target_height = max(1ULL, ((unsigned long long)img.height * target_width + img.width / 2) / img.width);
+        target_width = min(target_width, img.width);
+        target_height = min(target_height, img.height);
+
+        if (qoi_input)
+        {
+            istringstream decoded(string(img.pixels.begin(), img.pixels.end()));
+            load_thumbnail(decoded, 0, img.width, img.height, target_width, target_height, img.pixels);
+        }
+        else
+        {
+            load_thumbnail(ifs, img.start_byte, img.width, img.height, target_width, target_height, img.pixels);
+        }
+        img.width = target_width;
+        img.height = target_height;
+    }
+    // The header is valid, so the pixel array is read straight from the file into the image.
+    else if (!qoi_input)
+    {
+        img.pixels.resize((unsigned long long)size - img.start_byte);
+        ifs.seekg(img.start_byte, ios::beg);
+        ifs.read((char *)&img.pixels[0], img.pixels.size());
+    }
+
+    // The geometric transforms run before the decomposer, on the pixel array, and are part of the load time.
+    for (unsigned int t = 0; t < opt.transforms.size(); t++)
+    {
+        vector<unsigned char> transformed;
+        transform_pixels(img.pixels, transformed, img.width, img.height, opt.transforms[t]);
+        img.pixels.swap(transformed);
+    }
+
+    /*
+     The regions of the image that are processed, with rows in stored order (from the bottom).
+     Each region is filtered with its halo as if it was the whole image, and then copied into the result.
+     With no regions the whole image is filtered.
+    */
+    vector<rectangle> regions;
+    if (opt.roi)
+    {
+        if (opt.roi_x >= img.width || opt.roi_y >= img.height)
+        {
+            print_error(record, img.output_file_path, " region of interest is outside the image");
+            return;
+        }
+        rectangle r;
+        r.col = opt.roi_x;
+        r.width = min(opt.roi_width, img.width - opt.roi_x);
+        r.height = min(opt.roi_height, img.height - opt.roi_y);
+        r.row = img.height - opt.roi_y - r.height;
+        regions.push_back(r);
+    }
+
+    /*
+     In incremental mode the result is the previous output, patched where the input changed.
+     Every changed area is grown by the halo, since those are the output pixels it can change.
+     Images without a valid previous version of the same size are processed whole.
+    */
+    vector<unsigned char> previous_output;
+    bool patch = false;
+    if (opt.incremental)
+    {
+        unsigned int previous_width, previous_height, output_width, output_height;
+        vector<unsigned char> previous_input;
+        if (read_bmp_pixels(opt.previous_input_path + "/" + img.name, previous_width, previous_height, previous_input) &&
+            read_bmp_pixels(opt.previous_output_path + "/" + img.name, output_width, output_height, previous_output) &&
+            previous_width == img.width && previous_height == img.height && output_width == img.width && output_height == img.height)
+        {
+            patch = true;
+            regions = dirty_regions(previous_input, img.pixels, img.width, img.height);
+            for (unsigned int k = 0; k < regions.size(); k++)
+                regions[k] = grow_rectangle(regions[k], opt.halo, img.width, img.height);
+
+            // When the regions and the halo they read cover as much as the image, the whole image is filtered instead.
+            if (merge_regions(regions, opt.halo, img.width, img.height) >= (unsigned long long)img.width * img.height)
+            {
+                patch = false;
+                regions.clear();
+            }
+        }
+    }
+
+    // The decomposer is included in the load operation.
+    auto load_end = chrono::high_resolution_clock::now();
+
+    stage_times times = {0, 0, 0, 0, 0};
+    unsigned long long processed_pixels = 0;
+    if (!opt.roi && !patch)
+    {
+        filter_image(img, opt, times);
+        processed_pixels = (unsigned long long)img.width * img.height;
+    }
+    else
+    {
+        /*
+         The result the regions are copied into: a new image of the region with --roi-crop, the previous
+         output in incremental mode, and otherwise the untouched image itself.
+        */
+        vector<unsigned char> result;
+        unsigned int result_width = img.width;
+        unsigned int result_height = img.height;
+        int result_col = 0, result_row = 0;
+        if (opt.roi_crop)
+        {
+            result_width = regions[0].width;
+            result_height = regions[0].height;
+            result_col = regions[0].col;
+            result_row = regions[0].row;
+            result.resize((size_t)((result_width * 3 + 3) / 4 * 4) * result_height);
+        }
+        else if (patch)
+        {
+            result.swap(previous_output);
+        }
+
+        for (unsigned int k = 0; k < regions.size(); k++)
+        {
+            // The halo is clipped at the borders of the image.
+            rectangle h = grow_rectangle(regions[k], opt.halo, img.width, img.height);
+            image part;
+            part.width = h.width;
+            part.height = h.height;
+            part.pixels.resize((size_t)((h.width * 3 + 3) / 4 * 4) * h.height);
+            copy_region(img.pixels, img.width, h.col, h.row, part.pixels, h.width, 0, 0, h.width, h.height);
+
+            filter_image(part, opt, times);
+            processed_pixels += (unsigned long long)h.width * h.height;
+
+            // Drop the halo and copy the region into the result.
+            vector<unsigned char> &target = (opt.roi_crop || patch) ? result : img.pixels;
+            copy_region(part.pixels, part.width, regions[k].col - h.col, regions[k].row - h.row,
+                        target, result_width, regions[k].col - result_col, regions[k].row - result_row, regions[k].width, regions[k].height);
+        }
+
+        if (opt.roi_crop || patch)
+        {
+            img.pixels.swap(result);
+            img.width = result_width;
+            img.height = result_height;
+        }
+    }
+
+    // The recomposer time is considered to be part of the store time.
+    auto store_start = chrono::high_resolution_clock::now();
+    
+
+    /*      .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+                     STAGE 7 --- COPY IMAGE TO OUPUT FOLDER 
+          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
+    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
+    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
+    */
+
+    unsigned int file_size = 54 + (unsigned int)img.pixels.size();
+    unsigned int img_size = img.pixels.size();
+    
+    // Fill the final header.
+
+    img.raw_header[0] = 'B';
+    img.raw_header[1] = 'M';
+
+    img.raw_header[2] = file_size;
+    img.raw_header[3] = file_size >> 8;
+    img.raw_header[4] = file_size >> 16;
+    img.raw_header[5] = file_size >> 24;
+
+    img.raw_header[6] = '\0';
+    img.raw_header[7] = '\0';
+    img.raw_header[8] = '\0';
+    img.raw_header[9] = '\0';
+
+    img.raw_header[10] = 54;
+    img.raw_header[11] = '\0';
+    img.raw_header[12] = '\0';
+    img.raw_header[13] = '\0';
+
+    img.raw_header[14] = 40;
+    img.raw_header[15] = '\0';
+    img.raw_header[16] = '\0';
+    img.raw_header[17] = '\0';
+
+    img.raw_header[18] = img.width;
+    img.raw_header[19] = img.width >> 8;
+    img.raw_header[20] = img.width >> 16;
+    img.raw_header[21] = img.width >> 24;
+
+    img.raw_header[22] = img.height;
+    img.raw_header[23] = img.height >> 8;
+    img.raw_header[24] = img.height >> 16;
+    img.raw_header[25] = img.height >> 24;
+
+    img.raw_header[26] = 1;
+    img.raw_header[27] = '\0';
+
+    img.raw_header[28] = 24;
+    img.raw_header[29] = '\0';
+
+    img.raw_header[30] = '\0';
+    img.raw_header[31] = '\0';
+    img.raw_header[32] = '\0';
+    img.raw_header[33] = '\0';
+
+    img.raw_header[34] = img_size;
+    img.raw_header[35] = img_size >> 8;
+    img.raw_header[36] = img_size >> 16;
+    img.raw_header[37] = img_size >> 24;
+
+    img.raw_header[38] = 19;
+    img.raw_header[39] = 11;
+    img.raw_header[40] = '\0';
+    img.raw_header[41] = '\0';
+
+    img.raw_header[42] = 19;
+    img.raw_header[43] = 11;
+    img.raw_header[44] = '\0';
+    img.raw_header[45] = '\0';
+
+    img.raw_header[46] = '\0';
+    img.raw_header[47] = '\0';
+    img.raw_header[48] = '\0';
+    img.raw_header[49] = '\0';
+
+    img.raw_header[50] = '\0';
+    img.raw_header[51] = '\0';
+    img.raw_header[52] = '\0';
+    img.raw_header[53] = '\0';
+
+    // An image of an output bundle is encoded in memory and then appended to the bundle.
+    ofstream output_file;
+    ostringstream bundle_output;
+    ostream &file = opt.output_bundle != NULL ? (ostream &)bundle_output : output_file;
+    if (opt.output_bundle == NULL)
+        output_file.open(img.output_file_path, ios::binary);
+
+    // A QOI output is encoded row by row from the recomposed pixels, instead of the bmp header and pixels.
+    if (opt.qoi_output)
+    {
+        write_qoi(file, img.pixels, img.width, img.height);
+    }
+    else
+    {
+        // Write the header to the file.
+        for (unsigned char j : img.raw_header)
+        {
+            file << j;
+        }
+
+        // Write the pixels to the file.
+        file.write((const char *) &img.pixels[0], img.pixels.size());
+    }
+
+    if (opt.output_bundle != NULL)
+        append_to_bundle(*opt.output_bundle, img.output_file_path.substr(img.output_file_path.rfind('/') + 1), bundle_output.str());
+    else
+        output_file.close();
+
+    // The statistics are written next to the image, with its name and the json extension.
+    if (opt.stats)
+    {
+        string json = stats_json(img);
+        size_t extension = img.output_file_path.rfind('.');
+        string json_path = img.output_file_path;
+        if (extension != string::npos && extension > json_path.rfind('/'))
+            json_path.erase(extension);
+        json_path += ".json";
+        if (opt.output_bundle != NULL)
+        {
+            append_to_bundle(*opt.output_bundle, json_path.substr(json_path.rfind('/') + 1), json);
+        }
+        else
+        {
+            ofstream json_file(json_path);
+            json_file << json;
+        }
+    }
+    
+    // Finished storing the file.
+    auto store_end = chrono::high_resolution_clock::now();
+    auto global_end = chrono::high_resolution_clock::now();
+
+    auto load_time = chrono::duration_cast<chrono::microseconds>(load_end - load_start).count() + times.decompose;
+    auto sobel_time = times.sobel;
+    auto gauss_time = times.gauss;
+    auto store_time = chrono::duration_cast<chrono::microseconds>(store_end - store_start).count() + times.recompose;
+    auto global_time = chrono::duration_cast<chrono::microseconds>(global_end - global_start).count();
+
+    report.images++;
+    report.load_time += load_time;
+    report.gauss_time += gauss_time;
+    report.sobel_time += sobel_time;
+    report.store_time += store_time;
+
+    // Add the image processing times to the record.
+    if (!opt.quiet)
+    {
+        ostringstream log;
+        log << "File: " << img.input_file_path << " (time: " << global_time << ")\n";
+        log << "Load time: " << load_time << "\n";
+        log << filter_label(opt) << gauss_time << "\n";
+        log << edge_label(opt) << sobel_time << "\n";
+        log << "Store time: " << store_time << "\n";
+        if (opt.stats)
+        {
+            log << "Stats time: " << times.stats << "\n";
+        }
+        if (opt.watch)
+        {
+            log << "Arrival to output time: " << chrono::duration_cast<chrono::microseconds>(store_end - arrival).count() << "\n";
+        }
+        if (opt.incremental)
+        {
+            log << "Processed pixels: " << processed_pixels << " of " << (unsigned long long)img.width * img.height << "\n";
+        }
+        log << "\n";
+        record += log.str();
+    }
+}
+
+/*
+ Watch mode. Every image written or moved into in_path is processed as it arrives, and its record is written at once.
+ An image is only dispatched once it had no events for opt.debounce milliseconds, so an image written in several
+ steps is processed once it is complete. The images that become ready at the same time are processed together.
+*/
+int watch_directory(const string &in_path, const string &out_path, const options &opt)
+{
+    int notify = inotify_init();
+    if (notify < 0 || inotify_add_watch(notify, in_path.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0)
+    {
+        cerr << "Cannot watch directory " << in_path << ": " << strerror(errno) << "\n";
+        return -1;
+    }
+
+    // Images with events that are not processed yet, with the time of their first and last event.
+    struct arrival
+    {
+        string name;
+        chrono::high_resolution_clock::time_point first;
+        chrono::high_resolution_clock::time_point last;
+    };
+    vector<arrival> pending;
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (true)
+    {
+        // Without pending images wait for the next event, otherwise until the debounce time of them may be over.
+        pollfd watched = {notify, POLLIN, 0};
+        int ready = poll(&watched, 1, pending.empty() ? -1 : opt.debounce);
+        if (ready < 0 && errno != EINTR)
+            break;
+
+        if (ready > 0)
+        {
+            ssize_t length = read(notify, events, sizeof(events));
+            if (length <= 0)
+                break;
+            auto now = chrono::high_resolution_clock::now();
+            for (char *p = events; p < events + length; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+            {
+                struct inotify_event *event = (struct inotify_event *)p;
+
+                // The watched directory itself was removed.
+                if (event->mask & IN_IGNORED)
+                {
+                    close(notify);
+                    return 0;
+                }
+                if (event->len == 0 || (event->mask & IN_ISDIR))
+                    continue;
+
+                unsigned int k = 0;
+                while (k < pending.size() && pending[k].name != event->name)
+                    k++;
+                // An image moved away or deleted before it was processed is forgotten, like a temporary file that is renamed.
+                if (event->mask & (IN_MOVED_FROM | IN_DELETE))
+                {
+                    if (k < pending.size())
+                        pending.erase(pending.begin() + k);
+                }
+                else if (k == pending.size())
+                {
+                    arrival a = {event->name, now, now};
+                    pending.push_back(a);
+                }
+                else
+                {
+                    pending[k].last = now;
+                }
+            }
+        }
+
+        // Take the images without events in the last debounce milliseconds.
+        auto now = chrono::high_resolution_clock::now();
+        vector<arrival> batch;
+        for (unsigned int k = 0; k < pending.size();)
+        {
+            if (chrono::duration_cast<chrono::milliseconds>(now - pending[k].last).count() >= opt.debounce)
+            {
+                batch.push_back(pending[k]);
+                pending.erase(pending.begin() + k);
+            }
+            else
+            {
+                k++;
+            }
+        }
+        if (batch.empty())
+            continue;
+
+        vector<string> records(batch.size());
+        for (unsigned int k = 0; k < batch.size(); k++)
+        {
+            job_report file = {0, 0, 0, 0, 0, 0, 0};
+            process_file(in_path, out_path, batch[k].name, batch[k].first, opt, records[k], file);
+        }
+
+        for (unsigned int k = 0; k < records.size(); k++)
+        {
+            cout << records[k];
+        }
+        cout.flush();
+    }
+
+    cerr << "Cannot read the events of " << in_path << ": " << strerror(errno) << "\n";
+    close(notify);
+    return -1;
+}
+
+/*
+ Image read from stdin, the bytes it is read from (its own or a part of a bundle) and its log record.
+*/
+struct stream_image
+{
+    string name;
+    vector<unsigned char> bytes;
+    const unsigned char *data;
+    size_t size;
+    string record;
+};
+
+// Reads a little endian number of the given bytes from stdin.
+bool read_stream_number(unsigned long long &value, int bytes)
+{
+    unsigned char buffer[8];
+    if (!cin.read((char *)buffer, bytes))
+        return false;
+    value = get_number(buffer, bytes);
+    return true;
+}
+
+/*
+ Processes the images that arrive on stdin into out_path, a directory, or stdout when it is -. The stream is a
+ sequence of bmp files (each one ends where its header says), a stream of frames as the one written to stdout, or a
+ bundle, which is read whole. The images are processed one at a time: each one is read, filtered and written before
+ the next one is read, so only the bytes of one image are held besides a bundle.
+*/
+bool process_stdin(const string &out_path, const options &opt, vector<string> &records, job_report &report)
+{
+    options run = opt;
+    bundle_writer output_bundle;
+    if (opt.bundle_output || opt.stream_output)
+    {
+        if (!create_bundle(out_path, output_bundle, opt.stream_output && !opt.bundle_output))
+            return false;
+        run.output_bundle = &output_bundle;
+    }
+
+    // The first bytes tell the kind of stream. An empty stream has no images.
+    char magic[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    cin.read(magic, 2);
+    bool bmp_input = cin.gcount() == 2 && magic[0] == 'B' && magic[1] == 'M';
+    bool frame_input = false;
+    bundle_reader input_bundle;
+    vector<unsigned char> bundle_data;
+    if (cin.gcount() == 2 && !bmp_input)
+    {
+        cin.read(magic + 2, 6);
+        frame_input = memcmp(magic, "IMGSTRM1", 8) == 0;
+        if (memcmp(magic, "IMGBUND1", 8) == 0)
+        {
+            bundle_data.assign(magic, magic + 8);
+            char buffer[65536];
+            while (cin.read(buffer, sizeof(buffer)) || cin.gcount() > 0)
+                bundle_data.insert(bundle_data.end(), buffer, buffer + cin.gcount());
+            input_bundle.data = bundle_data.data();
+            input_bundle.size = bundle_data.size();
+            if (!read_bundle_index(input_bundle))
+            {
+                cerr << "The bundle on stdin is not valid\n";
+                return false;
+            }
+        }
+        else if (!frame_input)
+        {
+            cerr << "The stream on stdin is not made of bmp files, frames or a bundle\n";
+            return false;
+        }
+    }
+
+    // The images stay at the same address while more are read, and their bytes are freed when they are done.
+    deque<stream_image> images;
+
+    // Totals of the images, added as they finish.
+    job_report totals = {0, 0, 0, 0, 0, 0, 0};
+
+    for (unsigned int count = 0;; count++)
+    {
+        stream_image image;
+        if (input_bundle.data != NULL)
+        {
+            if (count == input_bundle.entries.size())
+                break;
+            image.name = input_bundle.entries[count].name;
+            image.data = input_bundle.data + input_bundle.entries[count].offset;
+            image.size = input_bundle.entries[count].size;
+        }
+        else if (frame_input)
+        {
+            // A frame is the size of the name, the name, the size of the image and the image.
+            unsigned long long name_size, size;
+            if (!read_stream_number(name_size, 4))
+                break;
+            image.name.resize(name_size);
+            if (name_size == 0 || !cin.read(&image.name[0], name_size) || !read_stream_number(size, 8))
+            {
+                cerr << "The stream on stdin ends inside a frame\n";
+                break;
+            }
+            image.bytes.resize(size);
+            if (size > 0 && !cin.read((char *)&image.bytes[0], size))
+            {
+                cerr << "The stream on stdin ends inside the image " << image.name << "\n";
+                break;
+            }
+        }
+        else if (bmp_input)
+        {
+            // A bmp file ends with its pixel array, placed by the header. The size in the header is not trusted, as for
+            // files. The first two bytes were read before.
+            if (count > 0 && (!cin.read(magic, 2) || magic[0] != 'B' || magic[1] != 'M'))
+            {
+                if (cin.gcount() > 0)
+                    cerr << "The stream on stdin has data that is not a bmp file after " << count << " images\n";
+                break;
+            }
+            unsigned char header[54] = {'B', 'M'};
+            if (!cin.read((char *)header + 2, 52))
+            {
+                cerr << "The stream on stdin ends inside the header of a bmp file after " << count << " images\n";
+                break;
+            }
+            unsigned long long start_byte = get_number(header + 10, 4);
+            unsigned long long height = get_number(header + 22, 4);
+            unsigned long long stride = (get_number(header + 18, 4) * get_number(header + 28, 2) + 31) / 32 * 4;
+            if (start_byte < 54 || (height > 0 && stride > ((1ULL << 32) - start_byte) / height))
+            {
+                cerr << "The stream on stdin has a bmp file with a wrong size after " << count << " images\n";
+                break;
+            }
+            unsigned long long size = start_byte + stride * height;
+            image.name = "image-" + to_string(count + 1) + ".bmp";
+            image.bytes.assign(header, header + 54);
+            image.bytes.resize(size);
+            if (size > 54 && !cin.read((char *)&image.bytes[54], size - 54))
+            {
+                cerr << "The stream on stdin ends inside " << image.name << "\n";
+                break;
+            }
+        }
+        else
+        {
+            break;
+        }
+
+        images.push_back(move(image));
+        stream_image *current = &images.back();
+        if (input_bundle.data == NULL)
+        {
+            current->data = current->bytes.data();
+            current->size = current->bytes.size();
+        }
+        auto arrival = chrono::high_resolution_clock::now();
+
+        // The image is read like an image of a bundle that only has it.
+        bundle_reader source;
+        bundle_entry entry = {current->name, 0, current->size};
+        source.data = current->data;
+        source.size = current->size;
+        source.entries.push_back(entry);
+        source.positions[current->name] = 0;
+        options task = run;
+        task.input_bundle = &source;
+
+        job_report file = {0, 0, 0, 0, 0, 0, 0};
+        process_file("-", out_path, current->name, arrival, task, current->record, file);
+        vector<unsigned char>().swap(current->bytes);
+
+        totals.images += file.images;
+        totals.skipped_files += file.skipped_files;
+        totals.skipped_bytes += file.skipped_bytes;
+        totals.load_time += file.load_time;
+        totals.gauss_time += file.gauss_time;
+        totals.sobel_time += file.sobel_time;
+        totals.store_time += file.store_time;
+    }
+
+    if (run.output_bundle != NULL)
+        finish_bundle(output_bundle);
+
+    for (unsigned int k = 0; k < images.size(); k++)
+        records.push_back(images[k].record);
+    report = totals;
+    return true;
+}
+
+/*
+ Processes every image of in_path into out_path (STAGES 2 to 7). The log record of every file is left in records,
+ in the order of the directory, and the totals in report. Returns false if the input directory cannot be opened.
+*/
+bool process_directory(const string &in_path, const string &out_path, const options &opt, vector<string> &records, job_report &report)
+{
+    /*
+     The input is a directory, or a bundle file that is mapped once. The bundles are set in the options of the run.
+     Returns false if the input cannot be read or the output bundle cannot be created.
+    */
+    options run = opt;
+    bundle_reader input_bundle;
+    bundle_writer output_bundle;
+    vector<string> names;
+
+    // The claims directory is shared by the workers, so the first one creates it.
+    if (!opt.claims.empty() && mkdir(opt.claims.c_str(), 0755) != 0 && errno != EEXIST)
+        return false;
+
+    // Open the input directory.
+    DIR *dr;
+    dr = opendir(in_path.c_str());
+    if (dr == NULL)
+    {
+        if (errno != ENOTDIR || !open_bundle(in_path, input_bundle))
+            return false;
+        run.input_bundle = &input_bundle;
+        for (unsigned int k = 0; k < input_bundle.entries.size(); k++)
+            names.push_back(input_bundle.entries[k].name);
+    }
+    if (opt.bundle_output || opt.stream_output)
+    {
+        if (!create_bundle(out_path, output_bundle, opt.stream_output && !opt.bundle_output))
+        {
+            if (dr != NULL)
+                closedir(dr);
+            close_bundle(input_bundle);
+            return false;
+        }
+        run.output_bundle = &output_bundle;
+    }
+
+    /*
+     Get the names of all the files and store them in a vector.
+     They are stored this way so that they can be divided among the threads.
+    */
+
+    struct dirent *f;
+    while (dr != NULL && (f = readdir(dr)))
+    {
+        // Skip the same and upper directory.
+        if ((strcmp(f->d_name, ".") != 0 && strcmp(f->d_name, "..")) != 0)
+            names.push_back(f->d_name);
+    }
+    
+    // A worker of a sharded run keeps only its part of the files.
+    if (opt.shard_count > 1)
+        select_shard(names, in_path, run.input_bundle, opt.shard_index, opt.shard_count, opt.shard_by_size);
+
+    /*
+     Log record of every file. Each image formats its lines in its own record, and the records are written
+     once all the images are done, so the loop does not flush the output stream.
+    */
+    records.assign(names.size(), string());
+
+    // Files rejected by the header checks and the bytes that were not read because of it.
+    unsigned int skipped_files = 0;
+    unsigned long long skipped_bytes = 0;
+
+    // Images written and the time of every stage added over all of them.
+    unsigned int images = 0;
+    long long load_total = 0, gauss_total = 0, sobel_total = 0, store_total = 0;
+
+    /*
+     Iterate over every file in the input directory.
+     One image is processed per loop.
+    */
+
+    for (unsigned int ii = 0; ii < names.size(); ii++)
+    {
+        job_report file = {0, 0, 0, 0, 0, 0, 0};
+        // With a claims directory an image is only processed by the worker that claims it.
+        if (!opt.claims.empty() && !claim_image(opt.claims, names[ii], opt.claim_timeout))
+            continue;
+
+        process_file(in_path, out_path, names[ii], chrono::high_resolution_clock::now(), run, records[ii], file);
+        if (!opt.claims.empty())
+            finish_claim(opt.claims, names[ii]);
+
+        images += file.images;
+        skipped_files += file.skipped_files;
+        skipped_bytes += file.skipped_bytes;
+        load_total += file.load_time;
+        gauss_total += file.gauss_time;
+        sobel_total += file.sobel_time;
+        store_total += file.store_time;
+    }
+
+    // Close the directory that was opened to read the images, or the bundles.
+    if (dr != NULL)
+        closedir(dr);
+    close_bundle(input_bundle);
+    if (run.output_bundle != NULL)
+        finish_bundle(output_bundle);
+
+    report.images = images;
+    report.skipped_files = skipped_files;
+    report.skipped_bytes = skipped_bytes;
+    report.load_time = load_total;
+    report.gauss_time = gauss_total;
+    report.sobel_time = sobel_total;
+    report.store_time = store_total;
+
+    return true;
+}
+
+/*
+ Writes the totals of the run to path, one "key value" line per total, so the reports of the workers of a sharded
+ run can be merged. The stage times are in microseconds and the total time in milliseconds.
+*/
+bool write_report(const string &path, const job_report &report, long long total_time)
+{
+    ofstream file(path);
+    file << "images " << report.images << "\n"
+         << "skipped_files " << report.skipped_files << "\n"
+         << "skipped_bytes " << report.skipped_bytes << "\n"
+         << "load_time " << report.load_time << "\n"
+         << "gauss_time " << report.gauss_time << "\n"
+         << "sobel_time " << report.sobel_time << "\n"
+         << "store_time " << report.store_time << "\n"
+         << "total_time " << total_time << "\n";
+    file.close();
+    return !file.fail();
+}
+
+/*
+ Merges the reports that the workers of a sharded run wrote with --report into one summary. The totals are added,
+ and the time of the run is the one of the slowest worker, since the workers run at the same time.
+*/
+int merge_reports(int count, char **paths)
+{
+    vector<string> keys;
+    unordered_map<string, long long> totals;
+    long long slowest = -1;
+    string slowest_path;
+
+    for (int k = 0; k < count; k++)
+    {
+        ifstream file(paths[k]);
+        if (!file)
+        {
+            cerr << "Cannot read the report " << paths[k] << "\n";
+            return -1;
+        }
+        string key;
+        long long value;
+        long long total_time = 0, images = 0;
+        while (file >> key >> value)
+        {
+            if (key == "total_time")
+            {
+                total_time = value;
+                continue;
+            }
+            if (key == "images")
+                images = value;
+            if (totals.find(key) == totals.end())
+                keys.push_back(key);
+            totals[key] += value;
+        }
+        cout << "Shard " << paths[k] << ": " << images << " images (time: " << (float)total_time / 1000 << ")\n";
+        if (total_time > slowest)
+        {
+            slowest = total_time;
+            slowest_path = paths[k];
+        }
+    }
+
+    cout << "\n"
+         << "Shards: " << count << "\n";
+    for (unsigned int k = 0; k < keys.size(); k++)
+    {
+        // The keys are written as the labels of the log, e.g. load_time as Load time.
+        string label = keys[k];
+        replace(label.begin(), label.end(), '_', ' ');
+        label[0] = toupper(label[0]);
+        cout << label << ": " << totals[keys[k]] << "\n";
+    }
+    cout << "Slowest shard: " << slowest_path << " (time: " << (float)slowest / 1000 << ")\n";
+    return 0;
+}
 
 int main(int argc, char **argv)
 {
@@ -32,26 +3904,34 @@ int main(int argc, char **argv)
     '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
     */
 
-    // If the number of arguments is different than three, stop execution.
-    if (argc != 4)
+    // The reports that the workers of a sharded run wrote are merged into one summary.
+    if (argc >= 2 && strcmp(argv[1], "--merge-reports") == 0)
+        return merge_reports(argc - 2, argv + 2);
+
+    // If there are less than three arguments, stop execution.
+    if (argc < 4)
     {
         cerr << "Wrong format:\n"
-             << "image-seq operation in_path out_path\n"
-             << "operation: copy, gauss, sobel\n";
+             << "image-seq operation in_path|- out_path|- [--sigma value] [--fused] [--radius n] [--sigma-s n] [--sigma-r n] [--element wxh] [--thresholds low,high] [--size wxh] [--roi x,y,w,h] [--roi-crop] [--incremental prev_in prev_out] [--format bmp|qoi] [--bundle] [--quiet] [--watch] [--debounce ms] [--shard i/N] [--shard-by hash|size] [--claim dir] [--claim-timeout s] [--report file] [--tiles n]\n"
+             << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+             << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+             << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+             << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n"
+             << "image-seq --merge-reports report... merges the --report files of the shards of a run\n";
         return -1;
     }
 
-    // If the first word is distinct from copy, gauss or sobel, stop execution.
-    if (strcmp(argv[1], "copy") != 0 && strcmp(argv[1], "gauss") != 0 && strcmp(argv[1], "sobel") != 0)
-    {
-        cerr << "Unexpected operation: " << argv[1] << "\n"
-             << "image-seq operation in_path out path\n "
-             << "operation: copy, gauss, sobel\n";
+    // Operation and parameters of the command line.
+    options opt;
+    if (!parse_options(argc, argv, opt, cerr))
         return -1;
-    }
 
-    // Check if input directory exists and is accesible.
-    if (opendir(argv[2]) == NULL)
+    // A worker of a tiled image filters its tile of the files in_path and out_path.
+    if (opt.tile_count > 0)
+        return filter_tile(argv[2], argv[3], opt);
+
+    // Check if input directory exists and is accesible. The input - is stdin.
+    if (!opt.stream_input && opendir(argv[2]) == NULL)
     {
         if (errno == EACCES)
         {
@@ -60,7 +3940,10 @@ int main(int argc, char **argv)
                  << "input directory " << argv[3] << " cannot be open"
                  << "\n"
                  << "image-seq operation in_path out_path\n"
-                 << "operation: copy, gauss, sobel\n";
+                 << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+                 << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+                 << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+                 << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
             return -1;
         }
         else if (errno == ENOENT)
@@ -69,13 +3952,16 @@ int main(int argc, char **argv)
                  << "Output path: " << argv[3] << "\n"
                  << "input directory " << argv[3] << " cannot access path\n"
                  << "image-seq operation in_path out_path\n"
-                 << "operation: copy, gauss, sobel\n";
+                 << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+                 << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+                 << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+                 << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
             return -1;
         }
     }
 
-    // Check if output directory exists and is accesible.
-    if (opendir(argv[3]) == NULL)
+    // Check if output directory exists and is accesible. An output bundle is a file that the run creates.
+    if (!opt.bundle_output && !opt.stream_output && opendir(argv[3]) == NULL)
     {
         if (errno == EACCES)
         {
@@ -83,7 +3969,10 @@ int main(int argc, char **argv)
                  << "Output path: " << argv[3] << "\n"
                  << "output directory " << argv[3] << " cannot be open\n"
                  << "image-seq operation in_path out_path\n"
-                 << "operation: copy, gauss, sobel\n";
+                 << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+                 << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+                 << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+                 << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
             return -1;
         }
         else if (errno == ENOENT)
@@ -92,574 +3981,49 @@ int main(int argc, char **argv)
                  << "Output path: " << argv[3] << "\n"
                  << "output directory " << argv[3] << " does not exist\n"
                  << "image-seq operation in_path out_path\n"
-                 << "operation: copy, gauss, sobel\n";
+                 << "operation: copy, gauss, sobel, sobel-luma, median, bilateral, erode, dilate, open, close, canny\n"
+                 << "transforms before the operation: rotate90, rotate180, rotate270, flip-h, flip-v (e.g. rotate90,sobel)\n"
+                 << "thumbnail before everything else reduces the image to --size (e.g. thumbnail,sobel)\n"
+                 << "stats before gauss or sobel, or alone, writes the histograms and statistics of every image as JSON (e.g. stats,sobel)\n";
             return -1;
         }
     }
 
 
-    // Extract the required operation.
-    bool gauss = (string)argv[1] == "gauss";
-    bool sobel = (string)argv[1] == "sobel";
-
-    /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                         STAGE 2 --- IMAGE EXTRACTION 
-          .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-    :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-    '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-    */
-
-    // Struct to store extracted picture.
-    struct raw_image
-    {
-        string name;
-        string output_file_path;
-        string input_file_path;
-        vector<char> raw_data;
-    };
-
-    // Open the input directory.
-    DIR *dr;
-    dr = opendir(argv[2]);
+    // The log goes to stderr when the images are written to stdout.
+    ostream &log_stream = opt.stream_output ? cerr : cout;
 
     // Print the input and output path.
-    cout << "Input path: " << argv[2] << endl;
-    cout << "Output path: " << argv[3] << endl;
-    cout << endl;
-
-    /*
-     Get all the file pointes and store the in a vector.
-     They are stored this way so that they can be divided among the threads.
-    */
-
-    vector<dirent*> files_th;
-    struct dirent *f;
-    while ((f = readdir(dr))) 
+    log_stream << "Input path: " << argv[2] << endl;
+    log_stream << "Output path: " << argv[3] << endl;
+    log_stream << endl;
+
+    // In watch mode only the images that arrive from now on are processed, until the program is stopped.
+    if (opt.watch)
+        return watch_directory(argv[2], argv[3], opt);
+
+    // Process the images of the input directory.
+    vector<string> records;
+    job_report report;
+    bool processed = opt.stream_input ? process_stdin(argv[3], opt, records, report) : process_directory(argv[2], argv[3], opt, records, report);
+    if (!processed)
     {
-        files_th.push_back(f);
+        cerr << "Cannot read the input " << argv[2] << (opt.bundle_output ? " or create the output bundle " : "") << (opt.bundle_output ? argv[3] : "")
+             << (opt.claims.empty() ? "" : " or create the claims directory ") << opt.claims << "\n";
+        return -1;
     }
-    
-    /*
-     Iterate over every file in the input directory.
-     One image is processed per loop.
-    */
 
-    for (unsigned int ii = 0; ii < files_th.size(); ii++)
+    // Write the records of every image in the order of the files, with a single flush.
+    for (unsigned int ii = 0; ii < records.size(); ii++)
     {
-        // Start the total time counter per image.
-        auto global_start = chrono::high_resolution_clock::now();
-        // Start counter for the load phase.
-        auto load_start = chrono::high_resolution_clock::now();
-
-        // Check that the file is not the same or upper directory.
-        if ((strcmp(files_th[ii]->d_name, ".") != 0 && strcmp(files_th[ii]->d_name, "..")) != 0)
-        {
-
-            // Get the path of the file.
-            std::string input_file_path = argv[2];
-            std::string output_file_path = argv[3];
-
-            // Check if the path has the last slash.
-            if (input_file_path.back() != '/')
-                input_file_path.append("/");
-            if (output_file_path.back() != '/')
-                output_file_path.append("/");
-
-            // Add the target image name to the path.
-            input_file_path += files_th[ii]->d_name;
-            output_file_path += files_th[ii]->d_name;
-
-            // Get the size of the file by moving the file pointer at the end.
-            ifstream ifs(input_file_path, ios::binary | ios::ate);
-            ifstream::pos_type size = ifs.tellg();
-
-            // Create the raw image structure.
-            raw_image raw_img;
-
-            // Set the original file name.
-            raw_img.output_file_path = output_file_path;
-            raw_img.input_file_path = input_file_path;
-            raw_img.name = files_th[ii]->d_name;
-
-            //Reads the contents of the file into the raw image.
-            ifs.seekg(0, ios::beg);
-            raw_img.raw_data.resize(size);
-            ifs.read(&raw_img.raw_data[0], size);
-
-
-            /*
-             The raw image struct will be converted into an image struct.
-             This struct will be used till the end and contains all the image information.
-            */
-
-            struct image
-            {
-                string name;
-                string output_file_path;
-                string input_file_path;
-                unsigned int size;
-                unsigned int width;
-                unsigned int height;
-                unsigned int start_byte;
-                unsigned char raw_header[54];
-                vector<unsigned char> pixels;
-            };
-
-            image img;
-
-            // Copy values from raw image to the new struct.
-            img.output_file_path = raw_img.output_file_path;
-            img.input_file_path = raw_img.input_file_path;
-            img.name = raw_img.name;
-
-            // Chech that images have BM header. Stop if they do not.
-            if (!(raw_img.raw_data[0] == 'B' && raw_img.raw_data[1] == 'M'))
-            {
-                cerr << "The image" << raw_img.name << "is not a bmp file \n";
-                continue;
-            }
-
-            // Get the number of planes.
-            unsigned int num_planes = (((unsigned int)(unsigned char)raw_img.raw_data[27]) << 8) + (unsigned int)(unsigned char)raw_img.raw_data[26];
-
-            // Get the point size.
-            unsigned int point_size = (((unsigned int)(unsigned char)raw_img.raw_data[29]) << 8) + (unsigned int)(unsigned char)raw_img.raw_data[28];
-
-            // Get the compression variable.
-            unsigned int compression = (((unsigned int)(unsigned char)raw_img.raw_data[33]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[32]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[31]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[30]);
-
-            // Check number of planes is one.
-            if (num_planes != 1)
-            {
-                print_error(img.output_file_path, " has more than one plane");
-                continue;
-            }
-
-            // Check point size is 24.
-            if (point_size != 24)
-            {
-                print_error(img.output_file_path, " does not have 24 bits");
-                continue;
-            }
-            
-            // Check the image compression is zero.
-            if (compression != 0)
-            {
-                print_error(img.output_file_path, " compression is different from 0");
-                continue;
-            }
-
-            // Get the image width.
-            img.width = (((unsigned int)(unsigned char)raw_img.raw_data[21]) << 24)
-                        + (((unsigned int)(unsigned char)raw_img.raw_data[20]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[19]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[18]);
-
-            // Get the height of the image.
-            img.height = (((unsigned int)(unsigned char)raw_img.raw_data[25]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[24]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[23]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[22]);
-
-            // Get the image start of data.
-            img.start_byte = (((unsigned int)(unsigned char)raw_img.raw_data[13]) << 24) + (((unsigned int)(unsigned char)raw_img.raw_data[12]) << 16) + (((unsigned int)(unsigned char)raw_img.raw_data[11]) << 8) + ((unsigned int)(unsigned char)raw_img.raw_data[10]);
-
-            // Extract the pixel array from the raw image.
-            img.pixels.insert(img.pixels.begin(), raw_img.raw_data.begin() + img.start_byte, raw_img.raw_data.end());
-
-
-            /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                                     STAGE 3 --- DECOMPOSER 
-                  .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-            */
-
-            // Create vectors for storing the decompose image.
-            vector<unsigned char> blue(img.height * img.width);
-            vector<unsigned char> red(img.height * img.width);
-            vector<unsigned char> green(img.height * img.width);
-
-            // Calculate the padding the raw image has.
-            int padding = 4 - ((img.width * 3) % 4);
-            if (padding == 4)
-                padding = 0;
-
-            // This width includes the padding.
-            int real_width = img.width * 3 + padding;
-
-            // This part is compulsory in order to be able to apply gauss and sobel opeartions.
-            if (gauss || sobel)
-            {
-
-                int real_index = 0;
-                for (unsigned j = 0; j < img.pixels.size(); j++)
-                {
-                    // This variables does not count the padding.
-                    real_index = j - ((j / real_width) * padding);
-
-                    if (j % real_width >= img.width * 3)
-                    {
-                        continue;
-                    }
-                    // Red pixels.
-                    else if (real_index % 3 == 0)
-                    {
-                        red[real_index/3] = (img.pixels[j]);
-                    }
-                    // Green pixels.
-                    else if (real_index % 3 == 1)
-                    {
-                        green[real_index/3] = (img.pixels[j]);
-                    }
-                    // Blue pixels.
-                    else
-                    {
-                        blue[real_index/3] = (img.pixels[j]);
-                    }
-                }
-            }
-
-            // The decomposer is included in the load operation.
-            auto load_end = chrono::high_resolution_clock::now();
-
-            /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                                 STAGE 4 --- GAUSS OPERATION
-                  .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-            */
-            auto gauss_start = chrono::high_resolution_clock::now();
-
-            //Gaussian blur matrix.
-            int m[5][5] = {
-                {1, 4, 7, 4, 1},
-                {4, 16, 26, 16, 4},
-                {7, 26, 41, 26, 7},
-                {4, 16, 26, 16, 4},
-                {1, 4, 7, 4, 1}};
-            int weight = 273;
-
-            //Sobel mask matrices.
-            int mx[3][3] = {
-                {1, 2, 1},
-                {0, 0, 0},
-                {-1, -2, -1}};
-
-            int my[3][3] = {
-                {-1, 0, 1},
-                {-2, 0, 2},
-                {-1, 0, 1}};
-            int w = 8;
-
-            // Vector to store changes after gauss operation.
-            vector<unsigned char> red_copy(red.size());
-            vector<unsigned char> blue_copy(blue.size());
-            vector<unsigned char> green_copy(green.size());
-
-            // Gauss is executed also if sobel is executed.
-            if (gauss || sobel)
-            {
-                for (int j = 0; j < (int)red.size(); j++)
-                {
-                    int col = j % img.width;
-                    int row = j / img.width;
-                    int result_red = 0;
-                    int result_blue = 0;
-                    int result_green = 0;
-                            
-                    for (int s = -2; s < 3; s++)
-                    {
-                        for (int t = -2; t < 3; t++)
-                        {
-                            // Check that operations outside image are excluded, and therefore treated as if the result was zero.
-                            if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
-                            {
-                                result_red += m[s + 3 - 1][t + 3 - 1] * red[(row + s) * img.width + (col + t)];
-                                result_blue += m[s + 3 - 1][t + 3 - 1] * blue[(row + s) * img.width + (col + t)];
-                                result_green += m[s + 3 - 1][t + 3 - 1] * green[(row + s) * img.width + (col + t)];
-                            }
-                        }
-                    }
-                    
-                    // The gauss execution results are stored in the <color>_copy vectors.
-                    red_copy[j] = result_red / weight;
-                    blue_copy[j] = result_blue / weight;
-                    green_copy[j] = result_green / weight;
-                }
-            }
-
-            auto gauss_end = chrono::high_resolution_clock::now();
-
-            /*       .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                                 STAGE 5 --- SOBEL OPERATION
-                  .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-            */
-            auto sobel_start = chrono::high_resolution_clock::now();
-
-            if (sobel)
-            {
-                float res_x_red;
-                float res_x_blue;
-                float res_x_green;
-
-                float res_y_red;
-                float res_y_blue;
-                float res_y_green;
-
-                for (int j = 0; j < (int)red.size(); j++)
-                {
-                    int col = j % img.width;
-                    int row = j / img.width;
-                    int result_red = 0;
-                    int result_blue = 0;
-                    int result_green = 0;
-
-                    // First sobel mask (mx)
-                    for (int s = -1; s < 2; s++)
-                    {
-                        for (int t = -1; t < 2; t++)
-                        {
-
-                            // Check that operations outside image are excluded, and therefore treated as if the result was zero.
-                            if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
-                            {
-                                result_red += mx[s + 2 - 1][t + 2 - 1] * red_copy[(row + s) * img.width + (col + t)];
-                                result_blue += mx[s + 2 - 1][t + 2 - 1] * blue_copy[(row + s) * img.width + (col + t)];
-                                result_green += mx[s + 2 - 1][t + 2 - 1] * green_copy[(row + s) * img.width + (col + t)];
-                            }
-                        }
-                    }
-
-                    res_x_red = (float) result_red /(float)  w;
-                    res_x_blue = (float) result_blue / (float) w;
-                    res_x_green = (float) result_green / (float) w;
-
-                    result_red = 0;
-                    result_blue = 0;
-                    result_green = 0;
-
-                    // Second sobel mask (my)
-                    for (int s = -1; s < 2; s++)
-                    {
-                        for (int t = -1; t < 2; t++)
-                        {
-
-                            // Check that operations outside image are excluded, and therefore treated as if the result was zero.
-                            if ((row + s >= 0) && (col + t >= 0) && (col + t < (int)img.width) && (row + s < (int)img.height))
-                            {
-                                result_red += my[s + 2 - 1][t + 2 - 1] * red_copy[(row + s) * img.width + (col + t)];
-                                result_blue += my[s + 2 - 1][t + 2 - 1] * blue_copy[(row + s) * img.width + (col + t)];
-                                result_green += my[s + 2 - 1][t + 2 - 1] * green_copy[(row + s) * img.width + (col + t)];
-                            }
-                        }
-                    }
-
-                    res_y_red = (float)result_red / (float)w;
-                    res_y_blue = (float)result_blue / (float)w;
-                    res_y_green = (float)result_green / (float)w;
-
-                    // The results of sobel are stored in the original vector, unlike the gauss ones.
-                    red[j] = static_cast<unsigned int>(abs(res_y_red) + abs(res_x_red));
-                    blue[j] = static_cast<unsigned int>(abs(res_y_green) + abs(res_x_green));
-                    green[j] = static_cast<unsigned int>(abs(res_y_blue) + abs(res_x_blue));
-                }
-            }
-
-            auto sobel_end = chrono::high_resolution_clock::now();
-
-            /*      .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                                 STAGE 6 --- RECOMPOSER 
-                  .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-            */
-
-            // The recomposer time is considered to be part of the store time.
-            auto store_start = chrono::high_resolution_clock::now();
-            
-            /*
-             This vectors point to the vector that contain the results that will be recomposed.
-             This was done to improve both performance and code legibility.
-            */
-
-            vector<unsigned char> *red_result;
-            vector<unsigned char> *green_result;
-            vector<unsigned char> *blue_result;
-
-            /* Since sobel results are stored in the original vectors and gauss results are stored in the <color>_copy vectors.
-             Pointers are used to get to the gauss results in _copy vectors (distinct from sobel ones).
-            */
-
-            if (gauss){
-                red_result = &red_copy;
-                green_result = &green_copy;
-                blue_result = &blue_copy;
-            }
-
-            // Pointers are used to get to the gauss results in original  vectors (distinct from gauss ones).
-            if(sobel){ 
-                red_result = &red;
-                green_result = &blue;
-                blue_result = &green;
-            }
-
-            // Recomposition is performed and merges the three colour vectors into the original image pixels vector that was decomposed.
-            if (gauss || sobel)
-            {
-                
-                int real_index = 0;
-                // The j index in this loop takes into account the padding.
-                for (unsigned j = 0; j < img.pixels.size(); j++)
-                {
-                    // This variable accounts for the pixel number without taking into account padding.
-                    real_index = j - ((j / real_width) * padding);
-
-                    if (j % real_width >= img.width * 3)
-                    {
-                        continue;
-                    }
-                    // Red pixels.
-                    else if (real_index % 3 == 0)
-                    {
-                        img.pixels[j] = (*red_result)[real_index/3];
-                    }
-                    // Green pixels.
-                    else if (real_index % 3 == 1)
-                    {
-                        img.pixels[j] = (*green_result)[real_index/3];
-                    }
-                    // Blue pixels.
-                    else
-                    {
-                        img.pixels[j] = (*blue_result)[real_index/3];
-                    }
-                }
-                
-            }
-            
-
-            /*      .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-                             STAGE 7 --- COPY IMAGE TO OUPUT FOLDER 
-                  .--.      .-'.      .--.      .--.      .--.      .--.      .`-.      .--.
-            :::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\::::::::.\
-            '      `--'      `.-'      `--'      `--'      `--'      `-.'      `--'      `
-            */
-
-            unsigned int file_size = 54 + (unsigned int)img.pixels.size();
-            unsigned int img_size = img.pixels.size();
-            
-            // Fill the final header.
-
-            img.raw_header[0] = 'B';
-            img.raw_header[1] = 'M';
-
-            img.raw_header[2] = file_size;
-            img.raw_header[3] = file_size >> 8;
-            img.raw_header[4] = file_size >> 16;
-            img.raw_header[5] = file_size >> 24;
-
-            img.raw_header[6] = '\0';
-            img.raw_header[7] = '\0';
-            img.raw_header[8] = '\0';
-            img.raw_header[9] = '\0';
-
-            img.raw_header[10] = 54;
-            img.raw_header[11] = '\0';
-            img.raw_header[12] = '\0';
-            img.raw_header[13] = '\0';
-
-            img.raw_header[14] = 40;
-            img.raw_header[15] = '\0';
-            img.raw_header[16] = '\0';
-            img.raw_header[17] = '\0';
-
-            img.raw_header[18] = img.width;
-            img.raw_header[19] = img.width >> 8;
-            img.raw_header[20] = img.width >> 16;
-            img.raw_header[21] = img.width >> 24;
-
-            img.raw_header[22] = img.height;
-            img.raw_header[23] = img.height >> 8;
-            img.raw_header[24] = img.height >> 16;
-            img.raw_header[25] = img.height >> 24;
-
-            img.raw_header[26] = 1;
-            img.raw_header[27] = '\0';
-
-            img.raw_header[28] = 24;
-            img.raw_header[29] = '\0';
-
-            img.raw_header[30] = '\0';
-            img.raw_header[31] = '\0';
-            img.raw_header[32] = '\0';
-            img.raw_header[33] = '\0';
-
-            img.raw_header[34] = img_size;
-            img.raw_header[35] = img_size >> 8;
-            img.raw_header[36] = img_size >> 16;
-            img.raw_header[37] = img_size >> 24;
-
-            img.raw_header[38] = 19;
-            img.raw_header[39] = 11;
-            img.raw_header[40] = '\0';
-            img.raw_header[41] = '\0';
-
-            img.raw_header[42] = 19;
-            img.raw_header[43] = 11;
-            img.raw_header[44] = '\0';
-            img.raw_header[45] = '\0';
-
-            img.raw_header[46] = '\0';
-            img.raw_header[47] = '\0';
-            img.raw_header[48] = '\0';
-            img.raw_header[49] = '\0';
-
-            img.raw_header[50] = '\0';
-            img.raw_header[51] = '\0';
-            img.raw_header[52] = '\0';
-            img.raw_header[53] = '\0';
-
-            ofstream file(img.output_file_path);
-
-            // Write the header to the file.
-            for (unsigned char j : img.raw_header)
-            {
-                file << j;
-            }
-
-            // Write the pixels to the file.
-            file.write((const char *) &img.pixels[0], img.pixels.size());
-
-            file.close();
-            
-            // Finished storing the file.
-            auto store_end = chrono::high_resolution_clock::now();
-            auto global_end = chrono::high_resolution_clock::now();
-
-            auto load_time = chrono::duration_cast<chrono::microseconds>(load_end - load_start).count();
-            auto sobel_time = chrono::duration_cast<chrono::microseconds>(sobel_end - sobel_start).count();
-            auto gauss_time = chrono::duration_cast<chrono::microseconds>(gauss_end - gauss_start).count();
-            auto store_time = chrono::duration_cast<chrono::microseconds>(store_end - store_start).count();
-            auto global_time = chrono::duration_cast<chrono::microseconds>(global_end - global_start).count();
+        log_stream << records[ii];
+    }
+    log_stream.flush();
 
-            // Print the image processing times.
-            cout << "File: " << img.input_file_path << " (time: " << global_time << ")" << endl;
-            cout << "Load time: " << load_time << endl;
-            cout << "Gauss time: " << gauss_time << endl;
-            cout << "Sobel time: " << sobel_time << endl;
-            cout << "Store time: " << store_time << endl;
-            cout << endl;
-        }
+    // Report the files rejected by the header checks. Their pixel data was never read.
+    if (report.skipped_files > 0)
+    {
+        log_stream << "Skipped files: " << report.skipped_files << " (" << report.skipped_bytes << " bytes not read)" << endl;
     }
 
     // Print the total time to process all the images.
@@ -667,7 +4031,12 @@ int main(int argc, char **argv)
     auto total_time = chrono::duration_cast<chrono::milliseconds>(total_end - total_start).count();
     std::cerr << "" << (float)total_time/1000 << endl;
 
-    closedir(dr); // Close the directory that was opened to read the images.
-    
+    // The totals of a worker are kept for the merge of the reports of all the shards.
+    if (!opt.report_path.empty() && !write_report(opt.report_path, report, total_time))
+    {
+        cerr << "Cannot write the report " << opt.report_path << "\n";
+        return -1;
+    }
+
     return 0;
 }
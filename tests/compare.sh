@@ -0,0 +1,172 @@
+#!/bin/sh
+#
+# Compares the partial modes of a build against a full run of the same operation over the images of tests/input.
+# They must give the same bytes as the full run. tests/output holds the sobel output of tests/input, so sobel is
+# also checked against it.
+#
+# Modes: --incremental, --roi, --tiles, the QOI round-trip and small batches (--small-pixels).
+# The fused sobel (--fused) is not exact: it must stay within 2 of sobel and sobel-luma inside the one pixel frame.
+# Bilateral and the hysteresis of canny are not local, so the halo of --roi is an approximation for them and
+# --incremental and --tiles refuse them: for canny and bilateral only the refusals, the QOI round-trip and small
+# batches are checked.
+#
+# Usage: tests/compare.sh binary [operation...]
+# e.g.   g++ -O2 -fopenmp parallel.cpp -o image-par && tests/compare.sh ./image-par sobel median close
+#
+# Exits with the number of failed comparisons.
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 binary [operation...]" >&2
+    exit 255
+fi
+binary=$1
+shift
+operations=${*:-copy gauss sobel sobel-luma median erode close canny bilateral}
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+failures=0
+
+# run args... runs the binary with its log in a file, and fails the comparison if it does not exit cleanly.
+run() {
+    if ! "$binary" "$@" > "$work/log" 2>&1; then
+        echo "FAIL: $binary $* exited with an error"
+        sed 's/^/    /' "$work/log"
+        failures=$((failures + 1))
+    fi
+}
+
+# refused args... runs the binary and fails the comparison if it does not refuse the command line.
+refused() {
+    if "$binary" "$@" > "$work/log" 2>&1; then
+        echo "FAIL: $binary $* did not refuse the options"
+        failures=$((failures + 1))
+    fi
+}
+
+# same name expected actual compares every image of the directory expected with the one of the same name in actual.
+same() {
+    for f in "$2"/*; do
+        if ! cmp -s "$f" "$3/$(basename "$f")"; then
+            echo "FAIL: $1 $(basename "$f")"
+            failures=$((failures + 1))
+        fi
+    done
+}
+
+# near name tolerance expected actual compares every image of the directory expected with the one of the same name
+# in actual: the headers must be the same, and the channels inside the one pixel frame at most tolerance apart.
+near() {
+    for f in "$3"/*; do
+        od -An -v -tu1 "$f" | tr -s ' ' '\n' | sed '/^$/d' > "$work/expected"
+        od -An -v -tu1 "$4/$(basename "$f")" | tr -s ' ' '\n' | sed '/^$/d' > "$work/actual"
+        if ! paste "$work/expected" "$work/actual" | awk -v tolerance="$2" '
+            $2 == "" { bad = 1 }
+            NR <= 54 { if ($1 != $2) bad = 1; h[NR - 1] = $1; next }
+            NR == 55 {
+                start = h[10] + 256 * h[11] + 65536 * h[12]
+                width = h[18] + 256 * h[19] + 65536 * h[20]
+                height = h[22] + 256 * h[23] + 65536 * h[24]
+                stride = int((3 * width + 3) / 4) * 4
+            }
+            {
+                i = NR - 1 - start
+                if (i < 0) next
+                row = int(i / stride)
+                col = int((i % stride) / 3)
+                d = $1 - $2
+                if (d < 0) d = -d
+                if (row > 0 && row < height - 1 && col > 0 && col < width - 1 && d > tolerance) bad = 1
+            }
+            END { exit bad }'; then
+            echo "FAIL: $1 $(basename "$f")"
+            failures=$((failures + 1))
+        fi
+    done
+}
+
+# The input of the incremental runs: tests/input with a few pixels changed at the start, the middle and the end of
+# the pixel data of every image, so some of the changes reach the borders.
+mkdir "$work/changed"
+for f in "$tests"/input/*.bmp; do
+    changed="$work/changed/$(basename "$f")"
+    cp "$f" "$changed"
+    size=$(wc -c < "$f")
+    for offset in 60 $((size / 2)) $((size / 2 + 3000)) $((size - 40)); do
+        printf '\377\000\377\000\377\000\377\000\377' | dd of="$changed" bs=1 seek="$offset" conv=notrunc 2> /dev/null
+    done
+done
+
+small_batches=no
+if "$binary" 2>&1 | grep -q -- --small-pixels; then
+    small_batches=yes
+fi
+
+for op in $operations; do
+    echo "Operation: $op"
+    local_filter=yes
+    if [ "$op" = canny ] || [ "$op" = bilateral ]; then
+        local_filter=no
+    fi
+    rm -rf "$work/out"
+    mkdir -p "$work/out/full" "$work/out/changed" "$work/out/incremental" "$work/out/tiles" "$work/out/qoi" \
+             "$work/out/qoi-bmp" "$work/out/batched" "$work/out/unbatched" "$work/out/roi" "$work/out/roi-crop" \
+             "$work/out/full-crop" "$work/out/roi-recrop" "$work/out/fused"
+
+    run "$op" "$tests/input" "$work/out/full"
+    if [ "$op" = sobel ]; then
+        same "sobel against tests/output" "$tests/output" "$work/out/full"
+    fi
+
+    # Fused: the one step sobel against the gauss and sobel stages.
+    if [ "$op" = sobel ] || [ "$op" = sobel-luma ]; then
+        run "$op" "$tests/input" "$work/out/fused" --fused
+        near "--fused" 2 "$work/out/full" "$work/out/fused"
+    fi
+
+    if [ $local_filter = no ]; then
+        refused "$op" "$work/changed" "$work/out/incremental" --incremental "$tests/input" "$work/out/full"
+        refused "$op" "$tests/input" "$work/out/tiles" --tiles 3
+    else
+        # Incremental: the changed images patched over the full output of tests/input, against a full run of them.
+        run "$op" "$work/changed" "$work/out/changed"
+        run "$op" "$work/changed" "$work/out/incremental" --incremental "$tests/input" "$work/out/full"
+        same "--incremental" "$work/out/changed" "$work/out/incremental"
+
+        # Tiles: every image filtered by three worker processes.
+        run "$op" "$tests/input" "$work/out/tiles" --tiles 3
+        same "--tiles" "$work/out/full" "$work/out/tiles"
+    fi
+
+    # QOI round-trip: the output written as QOI and copied back to bmp.
+    run "$op" "$tests/input" "$work/out/qoi" --format qoi
+    run copy "$work/out/qoi" "$work/out/qoi-bmp"
+    same "QOI round-trip" "$work/out/full" "$work/out/qoi-bmp"
+
+    # Small batches: every image in a batch, and none.
+    if [ $small_batches = yes ]; then
+        run "$op" "$tests/input" "$work/out/batched" --small-pixels 1000000
+        run "$op" "$tests/input" "$work/out/unbatched" --small-pixels 0
+        same "--small-pixels 1000000" "$work/out/full" "$work/out/batched"
+        same "--small-pixels 0" "$work/out/full" "$work/out/unbatched"
+    fi
+
+    # ROI: a region that touches the left border, cropped, and composited back and then cropped, against the same
+    # region of the full output.
+    if [ $local_filter = yes ]; then
+        roi=0,20,100,90
+        run copy "$work/out/full" "$work/out/full-crop" --roi $roi --roi-crop
+        run "$op" "$tests/input" "$work/out/roi-crop" --roi $roi --roi-crop
+        run "$op" "$tests/input" "$work/out/roi" --roi $roi
+        run copy "$work/out/roi" "$work/out/roi-recrop" --roi $roi --roi-crop
+        same "--roi --roi-crop" "$work/out/full-crop" "$work/out/roi-crop"
+        same "--roi" "$work/out/full-crop" "$work/out/roi-recrop"
+    fi
+done
+
+if [ $failures -eq 0 ]; then
+    echo "All the comparisons passed"
+else
+    echo "$failures comparisons failed"
+fi
+exit $failures